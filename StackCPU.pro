@@ -5,13 +5,31 @@ TEMPLATE = app
 
 
 SOURCES += \
+  cpuworker.cpp \
+  image.cpp \
+  jit.cpp \
   main.cpp \
   mainwindow.cpp \
-  stackcpu.cpp
+  memory.cpp \
+  memorymodel.cpp \
+  profiler.cpp \
+  stackcpu.cpp \
+  tokenizer.cpp \
+  trace.cpp \
+  verifier.cpp
 
 HEADERS += \
+  cpuworker.h \
+  image.h \
+  jit.h \
   mainwindow.h \
-  stackcpu.h
+  memory.h \
+  memorymodel.h \
+  profiler.h \
+  stackcpu.h \
+  tokenizer.h \
+  trace.h \
+  verifier.h
 
 FORMS += mainwindow.ui
-CONFIG += c++11
+CONFIG += c++11 thread
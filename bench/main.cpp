@@ -0,0 +1,415 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+// Benchmarks for the simulator over a small corpus of programs:
+// instructions per second for run() on every engine, assembly
+// throughput for compile(), the cost of clearStack() after a run has
+// written memory and of the refresh the GUI does after each step.
+// Results print like Google Benchmark's console output, or in its
+// JSON layout with --json for regression tracking.
+
+#include "stackcpu.h"
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <sstream>
+#include <thread>
+
+#define MEMSIZE 0x10000
+#define MINTIME 0.5
+#define MAXITERATIONS 1000000000LL
+// instructions run before each measured reset or refresh
+#define DIRTYSTEPS 10000
+#define STEPSPERREFRESH 100
+// written and removed again by the trace/* runs
+#define TRACEFILE "stackcpu-bench.trace"
+
+#define USAGE "usage: %s [--filter=substring] [--min-time=seconds] [--json]\n"
+
+struct Program {
+    string name;
+    vector<string> lines;
+};
+
+// Wall time over the measured parts of a batch; the rest, setup the
+// benchmark pauses for, is left out.
+class Timer {
+public:
+    Timer() : wall(0) {}
+    void start() { t0 = chrono::steady_clock::now(); }
+    void stop() { wall += chrono::duration<double>(chrono::steady_clock::now() - t0).count(); }
+    double seconds() const { return wall; }
+
+private:
+    chrono::steady_clock::time_point t0;
+    double wall;
+};
+
+// Runs n iterations and returns the items processed, e.g. instructions.
+typedef function<long long(long long n, Timer *t)> Body;
+
+struct Benchmark {
+    string name;
+    Body body;
+    // source bytes per item, for bytes_per_second
+    double bytes;
+};
+
+struct Result {
+    string name;
+    long long iterations;
+    double realTime, cpuTime;
+    double items, bytes;
+};
+
+static string itos(long long v) {
+    ostringstream o;
+    o << v;
+    return o.str();
+}
+
+// Tight nested counting loop, 6 instructions per inner iteration.
+static Program loopProgram() {
+    Program p;
+    p.name = "loop";
+    p.lines.push_back("LIT 100");
+    p.lines.push_back(":outer LIT 10000");
+    p.lines.push_back(":inner LIT 1 - DUP IF :next LIT 0 IF :inner");
+    p.lines.push_back(":next DROP LIT 1 - DUP IF :done LIT 0 IF :outer");
+    p.lines.push_back(":done HALT");
+    return p;
+}
+
+// Recursion 200 calls deep, repeated.
+static Program recursionProgram() {
+    Program p;
+    p.name = "recursion";
+    p.lines.push_back("LIT 5000");
+    p.lines.push_back(":outer LIT 200 CALL :down DROP LIT 1 - DUP IF :done LIT 0 IF :outer");
+    p.lines.push_back(":done HALT");
+    p.lines.push_back(":down DUP IF :bottom LIT 1 - CALL :down LIT 1 + EXIT");
+    p.lines.push_back(":bottom EXIT");
+    return p;
+}
+
+// Copies a 1000 word array with @ and !, repeated.
+static Program memoryProgram() {
+    Program p;
+    p.name = "memory";
+    p.lines.push_back("LIT 300");
+    p.lines.push_back(":outer LIT 1000");
+    p.lines.push_back(":inner DUP LIT 4096 + @ OVER LIT 8192 + ! LIT 1 - DUP IF :next LIT 0 IF :inner");
+    p.lines.push_back(":next DROP LIT 1 - DUP IF :done LIT 0 IF :outer");
+    p.lines.push_back(":done HALT");
+    return p;
+}
+
+// A large source: a main calling 4000 subroutines, one label each.
+static Program labelProgram() {
+    Program p;
+    p.name = "labels";
+    for (int i = 0; i < 4000; ++i) p.lines.push_back("CALL :sub" + itos(i));
+    p.lines.push_back("HALT");
+    for (int i = 0; i < 4000; ++i) p.lines.push_back(":sub" + itos(i) + " LIT " + itos(i % 100) + " DROP EXIT");
+    return p;
+}
+
+static void load(StackCPU *cpu, const Program &p) {
+    cpu->setMemSize(MEMSIZE);
+    cpu->setLines(p.lines);
+    if (!cpu->compile()) {
+        fprintf(stderr, "%s: %s at line %d\n", p.name.c_str(), cpu->error().c_str(), cpu->errorLine());
+        exit(1);
+    }
+}
+
+static void check(const StackCPU &cpu, bool ok, const Program &p) {
+    if (!ok) {
+        fprintf(stderr, "%s: %s at x%x\n", p.name.c_str(), cpu.error().c_str(), cpu.errorAddr());
+        exit(1);
+    }
+}
+
+// what a run benchmark turns on besides the engine
+enum Hooks { Plain, Profiled, Traced, Journaled };
+
+// A whole run of the program, with every instruction an item. Traced
+// runs of a batch go to one file, and the stopTrace() at the end,
+// which waits for the writer to catch up, is measured too.
+static Benchmark runBenchmark(const Program &p, StackCPU::Engine engine, const char *name, Hooks hooks = Plain) {
+    static const char *kinds[] = { "run/", "profile/", "trace/", "journal/" };
+    Benchmark b;
+    b.name = kinds[hooks] + p.name + "/" + name;
+    b.bytes = 0;
+    b.body = [p, engine, hooks](long long n, Timer *t) {
+        StackCPU cpu;
+        load(&cpu, p);
+        cpu.setEngine(engine);
+        cpu.setProfiling(hooks == Profiled);
+        cpu.setJournal(hooks == Journaled);
+        if (hooks == Traced) check(cpu, cpu.startTrace(TRACEFILE), p);
+        long long items = 0;
+        for (long long i = 0; i < n; ++i) {
+            cpu.clearStack();
+            t->start();
+            bool ok = cpu.run();
+            t->stop();
+            check(cpu, ok, p);
+            items += cpu.instructionCount();
+        }
+        if (hooks == Traced) {
+            t->start();
+            bool ok = cpu.stopTrace();
+            t->stop();
+            check(cpu, ok, p);
+            remove(TRACEFILE);
+        }
+        return items;
+    };
+    return b;
+}
+
+static Benchmark compileBenchmark(const Program &p) {
+    Benchmark b;
+    b.name = "compile/" + p.name;
+    size_t bytes = 0;
+    for (auto&& l : p.lines) bytes += l.size() + 1;
+    b.bytes = double(bytes) / p.lines.size();
+    b.body = [p](long long n, Timer *t) {
+        for (long long i = 0; i < n; ++i) {
+            StackCPU cpu;
+            cpu.setMemSize(MEMSIZE);
+            cpu.setLines(p.lines);
+            t->start();
+            bool ok = cpu.compile();
+            t->stop();
+            check(cpu, ok, p);
+        }
+        return n * (long long) p.lines.size();
+    };
+    return b;
+}
+
+// clearStack() after DIRTYSTEPS instructions, each counted as an item.
+static Benchmark resetBenchmark(const Program &p) {
+    Benchmark b;
+    b.name = "reset/" + p.name;
+    b.bytes = 0;
+    b.body = [p](long long n, Timer *t) {
+        StackCPU cpu;
+        load(&cpu, p);
+        cpu.clearStack();
+        for (long long i = 0; i < n; ++i) {
+            check(cpu, cpu.run(DIRTYSTEPS), p);
+            t->start();
+            cpu.clearStack();
+            t->stop();
+        }
+        return n;
+    };
+    return b;
+}
+
+// What the GUI does after a step: copy the registers and stacks out
+// as CpuWorker::capture() does, then compare the words of the pages
+// dirty now or at the last refresh with a shadow copy as
+// MemoryModel::refresh() does. Items are words in memory.
+static Benchmark refreshBenchmark(const Program &p) {
+    Benchmark b;
+    b.name = "refresh/" + p.name;
+    b.bytes = 0;
+    b.body = [p](long long n, Timer *t) {
+        StackCPU cpu;
+        load(&cpu, p);
+        cpu.clearStack();
+        int size = cpu.getMemSize();
+        vector<int> shadow(size), ds, rs, pages;
+        for (int a = 0; a < size; ++a) shadow[a] = cpu.memory(a);
+        long long changed = 0;
+        for (long long i = 0; i < n; ++i) {
+            if (cpu.halt()) cpu.clearStack();
+            check(cpu, cpu.run(STEPSPERREFRESH), p);
+            t->start();
+            ds.assign(cpu.dataStack().begin(), cpu.dataStack().end());
+            rs.assign(cpu.returnStack().begin(), cpu.returnStack().end());
+            const vector<int> &dirty = cpu.dirtyPages();
+            pages.insert(pages.end(), dirty.begin(), dirty.end());
+            sort(pages.begin(), pages.end());
+            pages.erase(unique(pages.begin(), pages.end()), pages.end());
+            for (auto&& pg : pages) {
+                int hi = min(size, (pg + 1) << PAGESHIFT);
+                for (int a = pg << PAGESHIFT; a < hi; ++a) {
+                    int m = cpu.memory(a);
+                    if (shadow[a] != m) {
+                        shadow[a] = m;
+                        ++changed;
+                    }
+                }
+            }
+            pages = dirty;
+            t->stop();
+        }
+        // keep the comparison from being optimised out
+        if (changed < 0) printf("%lld\n", changed);
+        return n * (long long) size;
+    };
+    return b;
+}
+
+// Like Google Benchmark: grow the iteration count until a batch takes
+// at least minTime, and report that batch. CPU time is that of the
+// whole batch, scaled to the share of it that was measured.
+static Result measure(const Benchmark &b, double minTime) {
+    long long n = 1;
+    for (;;) {
+        Timer t;
+        auto w0 = chrono::steady_clock::now();
+        clock_t c0 = clock();
+        long long items = b.body(n, &t);
+        double cpu = double(clock() - c0) / CLOCKS_PER_SEC;
+        double wall = chrono::duration<double>(chrono::steady_clock::now() - w0).count();
+        double s = t.seconds();
+        if (s >= minTime || n >= MAXITERATIONS) {
+            Result r;
+            r.name = b.name;
+            r.iterations = n;
+            r.realTime = s * 1e9 / n;
+            r.cpuTime = (wall > 0 ? cpu * s / wall : cpu) * 1e9 / n;
+            r.items = s > 0 ? items / s : 0;
+            r.bytes = r.items * b.bytes;
+            return r;
+        }
+        double mult = s > 0 ? minTime * 1.4 / s : 10;
+        n = min(MAXITERATIONS, max(n + 1, (long long) (n * min(mult, 10.0))));
+    }
+}
+
+static string jsonString(const string &s) {
+    string r = "\"";
+    for (auto&& c : s) {
+        if (c == '"' || c == '\\') r += '\\';
+        r += c;
+    }
+    return r + "\"";
+}
+
+static string human(double v) {
+    const char *suffix[] = { "", "k", "M", "G", "T" };
+    int i = 0;
+    while (v >= 1000 && i < 4) {
+        v /= 1000;
+        ++i;
+    }
+    char buff[32];
+    snprintf(buff, sizeof(buff), "%.4g%s", v, suffix[i]);
+    return buff;
+}
+
+static void printJson(const vector<Result> &results, const char *exe) {
+    char date[64];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    printf("{\n  \"context\": {\n");
+    printf("    \"date\": %s,\n", jsonString(date).c_str());
+    printf("    \"executable\": %s,\n", jsonString(exe).c_str());
+    printf("    \"num_cpus\": %u,\n", thread::hardware_concurrency());
+    printf("    \"jit\": %s\n", JitCompiler::supported() ? "true" : "false");
+    printf("  },\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        printf("    {\n      \"name\": %s,\n", jsonString(r.name).c_str());
+        printf("      \"run_name\": %s,\n", jsonString(r.name).c_str());
+        printf("      \"run_type\": \"iteration\",\n");
+        printf("      \"iterations\": %lld,\n", r.iterations);
+        printf("      \"real_time\": %.6e,\n", r.realTime);
+        printf("      \"cpu_time\": %.6e,\n", r.cpuTime);
+        printf("      \"time_unit\": \"ns\",\n");
+        if (r.bytes > 0) printf("      \"bytes_per_second\": %.6e,\n", r.bytes);
+        printf("      \"items_per_second\": %.6e\n", r.items);
+        printf("    }%s\n", i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+    string filter;
+    double minTime = MINTIME;
+    bool json = false;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a.compare(0, 9, "--filter=") == 0) {
+            filter = a.substr(9);
+        } else if (a.compare(0, 11, "--min-time=") == 0) {
+            minTime = atof(a.c_str() + 11);
+        } else if (a == "--json") {
+            json = true;
+        } else {
+            fprintf(stderr, USAGE, argv[0]);
+            return 2;
+        }
+    }
+
+    vector<Program> corpus;
+    corpus.push_back(loopProgram());
+    corpus.push_back(recursionProgram());
+    corpus.push_back(memoryProgram());
+    corpus.push_back(labelProgram());
+
+    vector<Benchmark> all;
+    for (auto&& p : corpus) {
+        all.push_back(runBenchmark(p, StackCPU::Interpreter, "interpreter"));
+        all.push_back(runBenchmark(p, StackCPU::Threaded, "threaded"));
+        all.push_back(runBenchmark(p, StackCPU::Jit, "jit"));
+    }
+    for (auto&& p : corpus) {
+        all.push_back(runBenchmark(p, StackCPU::Interpreter, "interpreter", Profiled));
+        all.push_back(runBenchmark(p, StackCPU::Threaded, "threaded", Profiled));
+    }
+    for (auto&& p : corpus) {
+        all.push_back(runBenchmark(p, StackCPU::Interpreter, "interpreter", Traced));
+        all.push_back(runBenchmark(p, StackCPU::Threaded, "threaded", Traced));
+    }
+    for (auto&& p : corpus) {
+        all.push_back(runBenchmark(p, StackCPU::Interpreter, "interpreter", Journaled));
+        all.push_back(runBenchmark(p, StackCPU::Threaded, "threaded", Journaled));
+    }
+    for (auto&& p : corpus) all.push_back(compileBenchmark(p));
+    for (auto&& p : corpus) all.push_back(resetBenchmark(p));
+    for (auto&& p : corpus) all.push_back(refreshBenchmark(p));
+
+    vector<Result> results;
+    if (!json) {
+        printf("%-28s %15s %15s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+        printf("%s\n", string(73, '-').c_str());
+    }
+    for (auto&& b : all) {
+        if (!filter.empty() && b.name.find(filter) == string::npos) continue;
+        Result r = measure(b, minTime);
+        results.push_back(r);
+        if (json) continue;
+        printf("%-28s %12.0f ns %12.0f ns %12lld", r.name.c_str(), r.realTime, r.cpuTime, r.iterations);
+        if (r.bytes > 0) printf(" bytes_per_second=%s/s", human(r.bytes).c_str());
+        printf(" items_per_second=%s/s\n", human(r.items).c_str());
+        fflush(stdout);
+    }
+    if (json) printJson(results, argv[0]);
+    return 0;
+}
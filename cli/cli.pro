@@ -0,0 +1,31 @@
+QT -= core gui
+CONFIG -= qt app_bundle
+CONFIG += console c++11 thread
+
+TARGET = stackcpu-cli
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+SOURCES += \
+  main.cpp \
+  ../image.cpp \
+  ../jit.cpp \
+  ../memory.cpp \
+  ../profiler.cpp \
+  ../stackcpu.cpp \
+  ../threadpool.cpp \
+  ../tokenizer.cpp \
+  ../trace.cpp \
+  ../verifier.cpp
+
+HEADERS += \
+  ../image.h \
+  ../jit.h \
+  ../memory.h \
+  ../profiler.h \
+  ../stackcpu.h \
+  ../threadpool.h \
+  ../tokenizer.h \
+  ../trace.h \
+  ../verifier.h
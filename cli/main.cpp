@@ -0,0 +1,308 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+// Headless runner: assembles and runs programs without Qt and prints
+// one JSON object per program on stdout.
+
+#include "stackcpu.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define MAXDUMP 0x10000
+
+#define USAGE \
+    "usage: %s [-m memsize] [-w 8|16|32] [-e interpreter|threaded|jit]\n" \
+    "       [-j jobs] [-s maxsteps] [-c] [-p] [-t] [-r] file|dir|-...\n"
+
+struct Result {
+    string file;
+    string json;
+    bool ok;
+};
+
+struct Options {
+    int memSize;
+    int wordBits;
+    StackCPU::Engine engine;
+    int jobs;
+    long long maxSteps;
+    bool compileOnly;
+    bool profile;
+    bool trace;
+    bool protect;
+};
+
+string jsonString(const string &s) {
+    string r = "\"";
+    for (auto&& c : s) {
+        switch (c) {
+        case '"': r += "\\\""; break;
+        case '\\': r += "\\\\"; break;
+        case '\n': r += "\\n"; break;
+        case '\t': r += "\\t"; break;
+        case '\r': r += "\\r"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char buff[8];
+                snprintf(buff, sizeof(buff), "\\u%04x", c);
+                r += buff;
+            } else {
+                r += c;
+            }
+        }
+    }
+    return r + "\"";
+}
+
+template <typename T>
+string jsonArray(const T &v) {
+    ostringstream o;
+    o << "[";
+    bool first = true;
+    for (int x : v) {
+        if (!first) o << ",";
+        o << x;
+        first = false;
+    }
+    o << "]";
+    return o.str();
+}
+
+// stack errors the verifier found, as an array of {addr, message}
+string jsonWarnings(const vector<Diagnostic> &v) {
+    ostringstream o;
+    o << "[";
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (i) o << ",";
+        o << "{\"addr\":" << v[i].addr << ",\"message\":" << jsonString(v[i].message) << "}";
+    }
+    o << "]";
+    return o.str();
+}
+
+bool isDir(const string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Whether path is named like a file the runner writes: an image, a
+// profile or a trace.
+bool isOutput(const string &path) {
+    static const char *exts[] = { ".img", ".prof", ".folded", ".trace" };
+    for (auto&& e : exts) {
+        size_t n = strlen(e);
+        if (path.size() > n && path.compare(path.size() - n, n, e) == 0) return true;
+    }
+    return false;
+}
+
+// regular files directly inside dir, sorted by name; dot files and
+// the runner's own outputs skipped, so a directory can be run again
+void listDir(const string &dir, vector<string> *files) {
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        files->push_back(dir);
+        return;
+    }
+    vector<string> names;
+    while (struct dirent *e = readdir(d)) {
+        if (e->d_name[0] == '.') continue;
+        string path = dir + "/" + e->d_name;
+        if (!isDir(path) && !isOutput(path)) names.push_back(path);
+    }
+    closedir(d);
+    sort(names.begin(), names.end());
+    files->insert(files->end(), names.begin(), names.end());
+}
+
+Result runFile(const string &file, const Options &opt) {
+    Result res;
+    ostringstream o;
+    res.file = file;
+    res.ok = false;
+    o << "{\"file\":" << jsonString(file);
+
+    // "-" is a source piped on stdin, assembled as it arrives
+    bool piped = file == "-";
+    string base = piped ? "stdin" : file;
+    StackCPU cpu;
+    cpu.setMemSize(opt.memSize);
+    cpu.setWordBits(opt.wordBits);
+    cpu.setEngine(opt.engine);
+    cpu.setProtectCode(opt.protect);
+    bool compiled;
+    if (piped) {
+        compiled = cpu.compile(0);
+    } else {
+        ifstream in(file.c_str(), ios::binary);
+        if (!in) {
+            o << ",\"compiled\":false,\"error\":\"cannot open file\"}";
+            res.json = o.str();
+            return res;
+        }
+        char magic[4] = {0};
+        in.read(magic, 4);
+        bool image = in.gcount() == 4 && memcmp(magic, "SCPU", 4) == 0;
+        in.clear();
+        in.seekg(0);
+        compiled = image ? cpu.loadImage(file) : cpu.compile(in);
+    }
+    if (!compiled) {
+        o << ",\"compiled\":false"
+          << ",\"error\":" << jsonString(cpu.error())
+          << ",\"errorAddr\":" << cpu.errorAddr()
+          << ",\"errorLine\":" << cpu.errorLine() << "}";
+        res.json = o.str();
+        return res;
+    }
+
+    if (opt.compileOnly) {
+        string out = base + ".img";
+        res.ok = cpu.saveImage(out);
+        o << ",\"compiled\":true,\"ok\":" << (res.ok ? "true" : "false");
+        if (!cpu.diagnostics().empty()) o << ",\"warnings\":" << jsonWarnings(cpu.diagnostics());
+        if (res.ok) o << ",\"image\":" << jsonString(out);
+        else o << ",\"error\":" << jsonString(cpu.error());
+        o << "}";
+        res.json = o.str();
+        return res;
+    }
+
+    cpu.setProfiling(opt.profile);
+    string trace = base + ".trace";
+    bool traced = opt.trace && cpu.startTrace(trace);
+    cpu.clearStack();
+    res.ok = cpu.run(opt.maxSteps);
+    if (traced) traced = cpu.stopTrace();
+    bool budget = res.ok && cpu.stopReason() == StackCPU::StopBudget;
+    if (budget) res.ok = false;
+    o << ",\"compiled\":true,\"ok\":" << (res.ok ? "true" : "false")
+      << ",\"halt\":" << (cpu.halt() ? "true" : "false")
+      << ",\"steps\":" << cpu.instructionCount();
+    if (!cpu.diagnostics().empty()) o << ",\"warnings\":" << jsonWarnings(cpu.diagnostics());
+    if (budget) {
+        o << ",\"error\":\"instruction limit exceeded\"";
+    } else if (!res.ok) {
+        o << ",\"error\":" << jsonString(cpu.error())
+          << ",\"errorAddr\":" << cpu.errorAddr();
+    }
+    if (opt.profile) {
+        const vector<Symbol> &syms = cpu.image()->symbols();
+        string out = base + ".prof";
+        ofstream prof(out.c_str());
+        ofstream folded((base + ".folded").c_str());
+        prof << cpu.profile().report(syms);
+        folded << cpu.profile().folded(syms);
+        if (prof && folded) o << ",\"profile\":" << jsonString(out);
+    }
+    if (traced) o << ",\"trace\":" << jsonString(trace);
+    o << ",\"pc\":" << cpu.pc()
+      << ",\"ds\":" << jsonArray(cpu.dataStack())
+      << ",\"rs\":" << jsonArray(cpu.returnStack());
+    // memory dumps stop at 64K words
+    if (cpu.getMemSize() <= MAXDUMP) {
+        vector<int> mem;
+        for (int i = 0; i < cpu.getMemSize(); ++i) mem.push_back(cpu.memory(i));
+        o << ",\"mem\":" << jsonArray(mem);
+    }
+    o << "}";
+    res.json = o.str();
+    return res;
+}
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    opt.memSize = 32;
+    opt.wordBits = 32;
+    opt.engine = StackCPU::Threaded;
+    opt.jobs = thread::hardware_concurrency();
+    opt.maxSteps = -1;
+    opt.compileOnly = false;
+    opt.profile = false;
+    opt.trace = false;
+    opt.protect = false;
+    vector<string> files;
+
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if ((a == "-m" || a == "-w" || a == "-e" || a == "-j" || a == "-s") && i + 1 < argc) {
+            string v = argv[++i];
+            if (a == "-m") {
+                opt.memSize = atoi(v.c_str());
+            } else if (a == "-w") {
+                opt.wordBits = atoi(v.c_str());
+            } else if (a == "-s") {
+                opt.maxSteps = atoll(v.c_str());
+            } else if (a == "-j") {
+                opt.jobs = atoi(v.c_str());
+            } else if (v == "interpreter") {
+                opt.engine = StackCPU::Interpreter;
+            } else if (v == "threaded") {
+                opt.engine = StackCPU::Threaded;
+            } else if (v == "jit") {
+                opt.engine = StackCPU::Jit;
+            } else {
+                fprintf(stderr, USAGE, argv[0]);
+                return 2;
+            }
+        } else if (a == "-c") {
+            opt.compileOnly = true;
+        } else if (a == "-p") {
+            opt.profile = true;
+        } else if (a == "-t") {
+            opt.trace = true;
+        } else if (a == "-r") {
+            opt.protect = true;
+        } else if (a[0] == '-' && a != "-") {
+            fprintf(stderr, USAGE, argv[0]);
+            return 2;
+        } else if (isDir(a)) {
+            listDir(a, &files);
+        } else {
+            files.push_back(a);
+        }
+    }
+    // the workers would all read the one stdin at once
+    if (files.empty() || count(files.begin(), files.end(), "-") > 1 || opt.memSize <= 0
+            || (opt.wordBits != 8 && opt.wordBits != 16 && opt.wordBits != 32)) {
+        fprintf(stderr, USAGE, argv[0]);
+        return 2;
+    }
+    if (opt.jobs < 1) opt.jobs = 1;
+
+    vector<Result> results(files.size());
+    ThreadPool pool(opt.jobs);
+    pool.parallelFor(files.size(), [&](int i) {
+        results[i] = runFile(files[i], opt);
+    });
+
+    int status = 0;
+    for (auto&& r : results) {
+        printf("%s\n", r.json.c_str());
+        if (!r.ok) status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,77 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#include "cpuworker.h"
+#include "stackcpu.h"
+
+// time between progress updates, about 30 per second
+#define FRAMEMS 33
+
+#define REQNONE 0
+#define REQPAUSE 1
+#define REQSTOP 2
+
+CpuWorker::CpuWorker(StackCPU *cpu, QObject *parent) : QObject(parent), cpu(cpu), request(REQNONE) {
+    qRegisterMetaType<CpuState>();
+}
+
+// drop a request left over from the last run
+void CpuWorker::arm() {
+    request.fetchAndStoreOrdered(REQNONE);
+}
+
+void CpuWorker::pause() {
+    request.testAndSetOrdered(REQNONE, REQPAUSE);
+}
+
+void CpuWorker::stop() {
+    request.fetchAndStoreOrdered(REQSTOP);
+}
+
+// Run in frames of FRAMEMS, publishing the state after each one, until
+// the CPU stops by itself or pause() or stop() is requested. A paused
+// CPU is left where it is and can be started again; a stopped one is
+// reset.
+void CpuWorker::start() {
+    bool ok = true;
+    while (request.load() == REQNONE) {
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(FRAMEMS);
+        ok = cpu->runUntil(deadline);
+        if (!ok || cpu->stopReason() != StackCPU::StopBudget) break;
+        if (request.load() != REQNONE) break;
+        emit progress(capture(cpu));
+    }
+    if (request.fetchAndStoreOrdered(REQNONE) == REQSTOP) {
+        cpu->clearStack();
+        ok = true;
+    }
+    emit progress(capture(cpu));
+    emit finished(ok);
+}
+
+CpuState CpuWorker::capture(const StackCPU *cpu) {
+    CpuState s;
+    s.pc = cpu->pc();
+    s.steps = cpu->instructionCount();
+    for (int x : cpu->dataStack()) s.ds.append(x);
+    for (int x : cpu->returnStack()) s.rs.append(x);
+    return s;
+}
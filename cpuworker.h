@@ -0,0 +1,68 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#ifndef CPUWORKER_H
+#define CPUWORKER_H
+
+#include <QObject>
+#include <QAtomicInt>
+#include <QMetaType>
+#include <QVector>
+
+class StackCPU;
+
+// Registers and stacks copied out of a running CPU for display.
+struct CpuState {
+    int pc;
+    long long steps;
+    QVector<int> ds;
+    QVector<int> rs;
+};
+
+Q_DECLARE_METATYPE(CpuState)
+
+// Runs a StackCPU on whatever thread the worker lives on. The owner must
+// not touch the CPU between start() and finished(); pause() and stop()
+// may be called from any thread. The owner calls arm() before queuing
+// start(), so a request made while start() waits in the queue is kept.
+class CpuWorker : public QObject {
+    Q_OBJECT
+
+public:
+    explicit CpuWorker(StackCPU *cpu, QObject *parent = 0);
+    void arm();
+    void pause();
+    void stop();
+    static CpuState capture(const StackCPU *cpu);
+
+public slots:
+    void start();
+
+signals:
+    void progress(const CpuState &state);
+    void finished(bool ok);
+
+private:
+    StackCPU *cpu;
+    QAtomicInt request;
+};
+
+#endif // CPUWORKER_H
@@ -0,0 +1,355 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+// Differential fuzzer: decodes the input into a memory image, runs it
+// on the interpreter and on every faster engine in slices of varying
+// length, and aborts with a report at the first instruction where PC,
+// stacks, memory, stop reason or error differ from the interpreter.
+// Profiled engines must also end with the interpreter's profile, and
+// journaled ones step back through the same states it does.
+//
+// Built for libFuzzer by default; with FUZZ_STANDALONE it is a driver
+// that replays the given inputs or, with none, generates random ones.
+
+#include "stackcpu.h"
+#include <random>
+#include <sstream>
+
+#define MAXSTEPS 100000
+#define MAXDUMP 16
+#define OPCODES 0x12
+// how far past the code so far a forward jump may land
+#define REACH 16
+
+struct Config {
+    const char *name;
+    StackCPU::Engine engine;
+    bool optimize;
+    bool profile;
+    bool journal;
+};
+
+static const Config configs[] = {
+    { "interpreter", StackCPU::Interpreter, false, true, true },
+    { "threaded", StackCPU::Threaded, true, false, false },
+    { "threaded, unfused", StackCPU::Threaded, false, false, false },
+    { "jit", StackCPU::Jit, true, false, false },
+    { "threaded, profiled", StackCPU::Threaded, true, true, false },
+    { "threaded, journaled", StackCPU::Threaded, true, false, true }
+};
+#define NCONFIGS (sizeof(configs) / sizeof(configs[0]))
+
+#ifdef FUZZ_STANDALONE
+#define CRASHFILE "crash-input"
+// the input being run, written out on a difference so it can be
+// replayed
+static string input;
+#endif
+
+// Write the input out, if there is a file to write it to, and abort.
+static void fail() {
+#ifdef FUZZ_STANDALONE
+    if (FILE *f = fopen(CRASHFILE, "wb")) {
+        fwrite(input.data(), 1, input.size(), f);
+        fclose(f);
+        fprintf(stderr, "input written to " CRASHFILE "\n");
+    }
+#endif
+    abort();
+}
+
+static const int memSizes[] = { 16, 32, 64, 128, 256, 1024, 4096 };
+static const int wordBits[] = { 8, 16, 32 };
+
+// Input bytes, read front to back; zeros once they run out.
+class Input {
+public:
+    Input(const uint8_t *data, size_t size) : p(data), end(data + size) {}
+    bool empty() const { return p == end; }
+    int byte() { return p < end ? *p++ : 0; }
+
+private:
+    const uint8_t *p, *end;
+};
+
+// Builds a memory image out of input codes: mostly whole
+// instructions, their operands drawn from the next byte so literals
+// land inside memory and jumps mostly on instructions so far, then
+// raw small values, and any 16 or 32 bit value, invalid opcodes and
+// out of range targets among them. Stack depths are followed down
+// straight-line code; an op that would underflow there becomes a LIT,
+// so runs get past the first few words and underflows are left to
+// jumps and raw words. Tagged, only the instructions decode and raw
+// words are data.
+class Program {
+public:
+    explicit Program(int memSize) : memSize(memSize) { depth[0] = depth[1] = 0; }
+    bool full() const { return (int) words.size() + 4 >= memSize; }
+    vector<int> finish();
+    vector<unsigned char> tags() const;
+    void decode(Input *in);
+
+private:
+    int target(int b);
+
+    int memSize;
+    int depth[2];
+    vector<int> words, starts;
+};
+
+void Program::decode(Input *in) {
+    int b = in->byte();
+    if (b < 0xe8) {
+        const Opcode *op = opFind(0xff00 | (b < 0x30 ? 0 : b % OPCODES));
+        if (op->dsi > depth[0] || op->rsi > depth[1]) op = opFind(0xff00);
+        depth[0] += op->dso - op->dsi;
+        depth[1] += op->rso - op->rsi;
+        starts.push_back(words.size());
+        words.push_back(op->opc);
+        if (op->opc == 0xff00) words.push_back(in->byte() % memSize);
+        else if (op->pci == 2) words.push_back(target(in->byte()));
+    } else if (b < 0xf8) {
+        words.push_back(b - 0xe8);
+    } else if (b < 0xff) {
+        words.push_back(in->byte() | in->byte() << 8);
+    } else {
+        int v = 0;
+        for (int i = 0; i < 4; ++i) v |= in->byte() << (8 * i);
+        words.push_back(v);
+    }
+}
+
+int Program::target(int b) {
+    if (b < 0xe0 && !starts.empty()) return starts[b % starts.size()];
+    return min<int>(words.size() + b % REACH, memSize - 1);
+}
+
+// The program and a jump back to its start, rather than on into
+// zeroed memory.
+vector<int> Program::finish() {
+    starts.push_back(words.size());
+    starts.push_back(words.size() + 2);
+    words.insert(words.end(), { 0xff00, 0, 0xff0c, 0 });
+    return move(words);
+}
+
+vector<unsigned char> Program::tags() const {
+    vector<unsigned char> t(memSize / 8 + 1);
+    for (int a : starts) t[a >> 3] |= 1 << (a & 7);
+    return t;
+}
+
+static string stackText(StackView v) {
+    ostringstream o;
+    for (int x : v) o << " " << x;
+    return o.str();
+}
+
+// What differs between the two CPUs, or an empty string.
+static string differ(const StackCPU &a, bool aok, const StackCPU &b, bool bok) {
+    if (aok != bok) return "result";
+    if (a.instructionCount() != b.instructionCount()) return "instruction count";
+    if (a.pc() != b.pc()) return "pc";
+    if (a.halt() != b.halt()) return "halt";
+    if (a.stopReason() != b.stopReason()) return "stop reason";
+    if (!aok && (a.error() != b.error() || a.errorAddr() != b.errorAddr())) return "error";
+    if (stackText(a.dataStack()) != stackText(b.dataStack())) return "data stack";
+    if (stackText(a.returnStack()) != stackText(b.returnStack())) return "return stack";
+    for (int i = 0; i < a.getMemSize(); ++i) {
+        if (a.memory(i) != b.memory(i)) {
+            char buff[32];
+            snprintf(buff, sizeof(buff), "memory at x%x", i);
+            return buff;
+        }
+    }
+    return "";
+}
+
+static void dump(const char *name, const StackCPU &c, bool ok) {
+    fprintf(stderr, "  %-18s steps %lld pc x%x halt %d stop %d", name, c.instructionCount(), c.pc(),
+            c.halt(), c.stopReason());
+    if (!ok) fprintf(stderr, " error \"%s\" at x%x", c.error().c_str(), c.errorAddr());
+    fprintf(stderr, "\n  %-18s ds%s\n  %-18s rs%s\n", "", stackText(c.dataStack()).c_str(),
+            "", stackText(c.returnStack()).c_str());
+}
+
+// Both CPUs agreed at their snapshots and differ slice instructions
+// later. Narrow that down to the first instruction count at which
+// they differ, then report it and abort.
+static void report(StackCPU *ref, const Snapshot &rs, StackCPU *cpu, const Snapshot &cs,
+                   const Config &c, int slice, const Image &img) {
+    int lo = 0, hi = slice;
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        ref->restore(rs);
+        cpu->restore(cs);
+        bool a = ref->run(mid), b = cpu->run(mid);
+        if (differ(*ref, a, *cpu, b).empty()) lo = mid;
+        else hi = mid;
+    }
+    ref->restore(rs);
+    cpu->restore(cs);
+    long long start = ref->instructionCount();
+    int pc = ref->pc();
+    if (hi > 1) {
+        ref->run(hi - 1);
+        cpu->run(hi - 1);
+        pc = ref->pc();
+    }
+    bool a = ref->run(1), b = cpu->run(1);
+    // the engine may only differ when run further in one go
+    if (differ(*ref, a, *cpu, b).empty()) {
+        ref->restore(rs);
+        cpu->restore(cs);
+        a = ref->run(hi);
+        b = cpu->run(hi);
+    }
+    fprintf(stderr, "%s differs from interpreter in %s after instruction %lld, at x%x (%s)\n",
+            c.name, differ(*ref, a, *cpu, b).c_str(), start + hi, pc,
+            opGetOps(pc >= 0 && pc < img.size() ? ref->memory(pc) : 0).c_str());
+    dump("interpreter", *ref, a);
+    dump(c.name, *cpu, b);
+    fprintf(stderr, "  image, %d words:", img.size());
+    for (int i = 0; i < img.extent() && i < img.size(); ++i) {
+        if (i % MAXDUMP == 0) fprintf(stderr, "\n   ");
+        fprintf(stderr, " %x", img.data()[i] & 0xffff);
+    }
+    fprintf(stderr, "\n");
+    fail();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+#ifdef FUZZ_STANDALONE
+    input.assign(reinterpret_cast<const char *>(data), size);
+#endif
+    Input in(data, size);
+    int memSize = memSizes[in.byte() % (sizeof(memSizes) / sizeof(memSizes[0]))];
+    int mode = in.byte();
+    int bits = wordBits[mode % 3];
+    bool tagged = mode & 4;
+    unsigned seed = in.byte() | in.byte() << 8;
+    Program prog(memSize);
+    while (!in.empty() && !prog.full()) prog.decode(&in);
+    vector<int> words = prog.finish();
+    shared_ptr<const Image> img = make_shared<const Image>(move(words), memSize, vector<Symbol>(), bits,
+                                                           tagged ? prog.tags() : vector<unsigned char>());
+
+    vector<unique_ptr<StackCPU> > cpus;
+    for (size_t i = 0; i < NCONFIGS; ++i) {
+        cpus.push_back(unique_ptr<StackCPU>(new StackCPU(img)));
+        cpus[i]->setEngine(configs[i].engine);
+        cpus[i]->setOptimize(configs[i].optimize);
+        cpus[i]->setProfiling(configs[i].profile);
+        cpus[i]->setJournal(configs[i].journal);
+    }
+
+    // slices mostly short, so budgets end inside blocks and fused ops,
+    // sometimes long enough for blocks to turn hot
+    mt19937 r(seed);
+    vector<Snapshot> snaps(NCONFIGS);
+    vector<char> ok(NCONFIGS);
+    for (long long steps = 0; steps < MAXSTEPS; ) {
+        int slice = 1 + r() % (r() % 4 ? 16 : 2048);
+        for (size_t i = 0; i < NCONFIGS; ++i) {
+            snaps[i] = cpus[i]->snapshot();
+            ok[i] = cpus[i]->run(slice);
+        }
+        for (size_t i = 1; i < NCONFIGS; ++i) {
+            if (!differ(*cpus[0], ok[0], *cpus[i], ok[i]).empty()) {
+                report(cpus[0].get(), snaps[0], cpus[i].get(), snaps[i], configs[i], slice, *img);
+            }
+        }
+        if (!ok[0] || cpus[0]->halt()) break;
+        steps += slice;
+    }
+    const Profile &ref = cpus[0]->profile();
+    for (size_t i = 1; i < NCONFIGS; ++i) {
+        if (!configs[i].profile) continue;
+        const Profile &p = cpus[i]->profile();
+        if (p.report(vector<Symbol>()) != ref.report(vector<Symbol>())
+                || p.folded(vector<Symbol>()) != ref.folded(vector<Symbol>())) {
+            fprintf(stderr, "%s profile differs from interpreter\n--- interpreter\n%s%s--- %s\n%s%s",
+                    configs[i].name, ref.report(vector<Symbol>()).c_str(), ref.folded(vector<Symbol>()).c_str(),
+                    configs[i].name, p.report(vector<Symbol>()).c_str(), p.folded(vector<Symbol>()).c_str());
+            fail();
+        }
+    }
+    for (bool more = true; more; ) {
+        more = cpus[0]->stepBack();
+        for (size_t i = 1; i < NCONFIGS; ++i) {
+            if (!configs[i].journal) continue;
+            bool b = cpus[i]->stepBack();
+            string what = more != b ? "step back" : differ(*cpus[0], true, *cpus[i], true);
+            if (what.empty()) continue;
+            fprintf(stderr, "%s differs from interpreter in %s stepping back to instruction %lld\n",
+                    configs[i].name, what.c_str(), cpus[0]->instructionCount());
+            dump("interpreter", *cpus[0], true);
+            dump(configs[i].name, *cpus[i], true);
+            fail();
+        }
+    }
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+#include <fstream>
+
+#define USAGE "usage: %s [-n runs] [-s seed] [file...]\n"
+
+int main(int argc, char *argv[]) {
+    long long runs = 100000;
+    unsigned seed = 1;
+    vector<string> files;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if ((a == "-n" || a == "-s") && i + 1 < argc) {
+            if (a == "-n") runs = atoll(argv[++i]);
+            else seed = strtoul(argv[++i], NULL, 10);
+        } else if (a[0] == '-') {
+            fprintf(stderr, USAGE, argv[0]);
+            return 2;
+        } else {
+            files.push_back(a);
+        }
+    }
+
+    for (auto&& f : files) {
+        ifstream in(f.c_str(), ios::binary);
+        if (!in) {
+            fprintf(stderr, "%s: cannot open file\n", f.c_str());
+            return 1;
+        }
+        string s((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+    }
+    if (!files.empty()) return 0;
+
+    mt19937 r(seed);
+    vector<uint8_t> buf;
+    for (long long n = 0; n < runs; ++n) {
+        buf.resize(3 + r() % 512);
+        for (auto&& b : buf) b = r();
+        LLVMFuzzerTestOneInput(buf.data(), buf.size());
+    }
+    printf("%lld inputs, no differences\n", runs);
+    return 0;
+}
+#endif
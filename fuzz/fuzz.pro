@@ -0,0 +1,41 @@
+QT -= core gui
+CONFIG -= qt app_bundle
+CONFIG += console c++11 thread
+
+TARGET = stackcpu-fuzz
+TEMPLATE = app
+
+INCLUDEPATH += ..
+
+# libFuzzer needs clang; CONFIG+=standalone builds a driver with any
+# compiler that replays inputs or generates random ones
+standalone {
+  DEFINES += FUZZ_STANDALONE
+} else {
+  QMAKE_CC = clang
+  QMAKE_CXX = clang++
+  QMAKE_LINK = clang++
+  QMAKE_CXXFLAGS += -g -fsanitize=fuzzer,address,undefined
+  QMAKE_LFLAGS += -fsanitize=fuzzer,address,undefined
+}
+
+SOURCES += \
+  fuzz.cpp \
+  ../image.cpp \
+  ../jit.cpp \
+  ../memory.cpp \
+  ../profiler.cpp \
+  ../stackcpu.cpp \
+  ../tokenizer.cpp \
+  ../trace.cpp \
+  ../verifier.cpp
+
+HEADERS += \
+  ../image.h \
+  ../jit.h \
+  ../memory.h \
+  ../profiler.h \
+  ../stackcpu.h \
+  ../tokenizer.h \
+  ../trace.h \
+  ../verifier.h
@@ -0,0 +1,256 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#include "image.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define IMAGEMAGIC "SCPU"
+#define IMAGEVERSION 2
+#define IMAGETAGGED 0x1
+#define IMAGEBITS(f) (((f) >> 8) & 0xff)
+
+struct ImageHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t memSize;
+    uint32_t words;
+    uint32_t symbols;
+    uint32_t strings;
+    uint32_t checksum;
+    uint32_t flags;
+};
+
+static uint32_t fnv1a(uint32_t h, const void *buf, size_t n) {
+    const unsigned char *s = static_cast<const unsigned char *>(buf);
+    for (size_t i = 0; i < n; ++i) {
+        h ^= s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// bytes of tags for n words, padded to 32 bits
+static size_t tagBytes(size_t n) {
+    return (n + 31) / 32 * 4;
+}
+
+Image::Image() : p(NULL), t(NULL), len(0), n(0), wbits(32), map(NULL), mapSize(0) {
+}
+
+Image::Image(vector<int> words, int size, vector<Symbol> symbols, int bits, vector<unsigned char> tags)
+    : words(move(words)), tagBits(move(tags)), syms(move(symbols)), n(size), wbits(bits),
+      map(NULL), mapSize(0) {
+    if (this->words.size() > (size_t) n) this->words.resize(n);
+    p = this->words.data();
+    len = static_cast<int>(this->words.size());
+    t = NULL;
+    if (!tagBits.empty()) {
+        // never empty, so that an image without words stays tagged
+        tagBits.resize(max(tagBytes(len), (size_t) 4));
+        t = tagBits.data();
+    }
+}
+
+Image::~Image() {
+#ifndef _WIN32
+    if (map) munmap(map, mapSize);
+#endif
+}
+
+const int *Image::data() const {
+    return p;
+}
+
+int Image::size() const {
+    return n;
+}
+
+int Image::extent() const {
+    return len;
+}
+
+const vector<Symbol> &Image::symbols() const {
+    return syms;
+}
+
+int Image::bits() const {
+    return wbits;
+}
+
+const unsigned char *Image::tags() const {
+    return t;
+}
+
+shared_ptr<const Decoding> Image::decoding(int key) const {
+    lock_guard<mutex> g(decodingLock);
+    auto it = decodings.find(key);
+    if (it == decodings.end()) return NULL;
+    return it->second;
+}
+
+// CPUs running the image on other threads look decodings up while one
+// is set, so both take the lock.
+void Image::setDecoding(int key, shared_ptr<const Decoding> d) const {
+    lock_guard<mutex> g(decodingLock);
+    decodings[key] = d;
+}
+
+bool Image::save(const string &path, string *error) const {
+    vector<uint32_t> table;
+    string strings;
+    for (auto&& s : syms) {
+        table.push_back(s.addr);
+        table.push_back(strings.size());
+        strings.append(s.name.c_str(), s.name.size() + 1);
+    }
+
+    ImageHeader h;
+    memcpy(h.magic, IMAGEMAGIC, 4);
+    h.version = IMAGEVERSION;
+    h.memSize = n;
+    h.words = len;
+    h.symbols = syms.size();
+    h.strings = strings.size();
+    size_t ntags = t ? tagBytes(len) : 0;
+    h.checksum = fnv1a(2166136261u, p, len * sizeof(int));
+    h.checksum = fnv1a(h.checksum, t, ntags);
+    h.checksum = fnv1a(h.checksum, table.data(), table.size() * sizeof(uint32_t));
+    h.checksum = fnv1a(h.checksum, strings.data(), strings.size());
+    h.flags = (t ? IMAGETAGGED : 0) | wbits << 8;
+
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+        *error = strerror(errno);
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+        && fwrite(p, sizeof(int), len, f) == (size_t) len
+        && fwrite(t, 1, ntags, f) == ntags
+        && fwrite(table.data(), sizeof(uint32_t), table.size(), f) == table.size()
+        && fwrite(strings.data(), 1, strings.size(), f) == strings.size();
+    if (fclose(f) != 0) ok = false;
+    if (!ok) *error = strerror(errno);
+    return ok;
+}
+
+shared_ptr<const Image> Image::open(const string &path, string *error) {
+    shared_ptr<Image> img(new Image());
+    const char *buf;
+    size_t size;
+#ifdef _WIN32
+    ifstream in(path.c_str(), ios::binary);
+    if (!in) {
+        *error = "cannot open file";
+        return NULL;
+    }
+    string all((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    img->words.resize((all.size() + sizeof(int) - 1) / sizeof(int));
+    memcpy(img->words.data(), all.data(), all.size());
+    buf = reinterpret_cast<const char *>(img->words.data());
+    size = all.size();
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *error = strerror(errno);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        *error = strerror(errno);
+        close(fd);
+        return NULL;
+    }
+    size = st.st_size;
+    if (size >= sizeof(ImageHeader)) {
+        img->map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (img->map == MAP_FAILED) {
+        img->map = NULL;
+        *error = strerror(errno);
+        return NULL;
+    }
+    img->mapSize = size;
+    buf = static_cast<const char *>(img->map);
+#endif
+
+    ImageHeader h;
+    if (size < sizeof(h)) {
+        *error = "file too short";
+        return NULL;
+    }
+    memcpy(&h, buf, sizeof(h));
+    if (memcmp(h.magic, IMAGEMAGIC, 4) != 0) {
+        *error = "not an image file";
+        return NULL;
+    }
+    if (h.version == 1) h.flags = 32 << 8;
+    else if (h.version != IMAGEVERSION) {
+        *error = "unsupported version";
+        return NULL;
+    }
+    int bits = IMAGEBITS(h.flags);
+    uint64_t ntags = h.flags & IMAGETAGGED ? tagBytes(h.words) : 0;
+    uint64_t body = (uint64_t) h.words * sizeof(int) + ntags + (uint64_t) h.symbols * 8 + h.strings;
+    if (h.memSize == 0 || h.memSize > 0x7fffffff || h.words > h.memSize
+        || (bits != 8 && bits != 16 && bits != 32) || sizeof(h) + body != size) {
+        *error = "corrupt header";
+        return NULL;
+    }
+    const char *words = buf + sizeof(h);
+    const char *tags = words + h.words * sizeof(int);
+    const uint32_t *table = reinterpret_cast<const uint32_t *>(tags + ntags);
+    const char *strings = reinterpret_cast<const char *>(table + h.symbols * 2);
+    if (fnv1a(2166136261u, words, body) != h.checksum) {
+        *error = "checksum mismatch";
+        return NULL;
+    }
+    if (h.strings > 0 && strings[h.strings - 1] != 0) {
+        *error = "corrupt symbol table";
+        return NULL;
+    }
+    for (uint32_t i = 0; i < h.symbols; ++i) {
+        if (table[2 * i + 1] >= h.strings) {
+            *error = "corrupt symbol table";
+            return NULL;
+        }
+        Symbol s = { strings + table[2 * i + 1], static_cast<int>(table[2 * i]) };
+        img->syms.push_back(s);
+    }
+    img->p = reinterpret_cast<const int *>(words);
+    img->t = h.flags & IMAGETAGGED ? reinterpret_cast<const unsigned char *>(tags) : NULL;
+    img->len = h.words;
+    img->n = h.memSize;
+    img->wbits = bits;
+    return img;
+}
@@ -0,0 +1,102 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+struct Decoding;
+
+// A label and the address it stands for.
+struct Symbol {
+    string name;
+    int addr;
+};
+
+// Compiled program: the initial contents of a memory of size() words.
+// Only the first extent() words are stored, the rest read as zero.
+// Images are immutable and shared by every CPU started from them.
+//
+// A program's data is bits() wide. Assembled images also tag the words
+// holding opcodes, so that data never runs as an instruction, however
+// it is spelt; images without tags decode any word that reads as an
+// opcode.
+//
+// save() writes the image file format, little-endian throughout:
+//   header    magic "SCPU", version, memory size, word count, symbol
+//             count, string table size, checksum, flags: bit 0 set
+//             when tagged, bits 8-15 the word width
+//   words     the first extent() words, 32 bits each
+//   tags      when tagged, a bit per word, padded to 32 bits
+//   symbols   address and string table offset per symbol
+//   strings   NUL-terminated symbol names
+// The checksum is FNV-1a over everything after the header. open()
+// maps the file and serves the words straight from the mapping.
+// Version 1 files, which have no flags, load as untagged and 32 bits
+// wide.
+class Image {
+public:
+    Image(vector<int> words, int size, vector<Symbol> symbols = vector<Symbol>(),
+          int bits = 32, vector<unsigned char> tags = vector<unsigned char>());
+    ~Image();
+    const int *data() const;
+    int size() const;
+    int extent() const;
+    const vector<Symbol> &symbols() const;
+    int bits() const;
+    // bit addr % 8 of byte addr / 8 is set for each opcode word among
+    // the first extent(); NULL for an untagged image
+    const unsigned char *tags() const;
+    // what a CPU decoded the image to under settings key, kept for the
+    // next; NULL until one has set it
+    shared_ptr<const Decoding> decoding(int key) const;
+    void setDecoding(int key, shared_ptr<const Decoding> d) const;
+    bool save(const string &path, string *error) const;
+    static shared_ptr<const Image> open(const string &path, string *error);
+
+private:
+    vector<int> words;
+    vector<unsigned char> tagBits;
+    vector<Symbol> syms;
+    const int *p;
+    const unsigned char *t;
+    int len;
+    int n;
+    int wbits;
+    void *map;
+    size_t mapSize;
+    mutable mutex decodingLock;
+    mutable unordered_map<int, shared_ptr<const Decoding> > decodings;
+
+    Image();
+    Image(const Image &);
+    Image &operator=(const Image &);
+};
+
+#endif // IMAGE_H
@@ -0,0 +1,601 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#include "jit.h"
+#include "stackcpu.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#ifdef JIT_X64
+#include <sys/mman.h>
+#endif
+
+#define CHUNKSIZE 0x10000
+
+#ifdef JIT_X64
+
+// x86-64 register numbers
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// scratch registers that may hold stack entries; rax is left for
+// results and the callee saved rbx, rbp, r12, r13 and r14 hold the
+// data stack, return stack, ctx, budget left and NativeExit
+static const int valueRegs[] = { RCX, RDX, RSI, RDI, R8, R9, R10, R11 };
+#define NVALUEREGS 8
+
+// ALU opcodes, register form and the /digit of the immediate form
+struct Alu {
+    unsigned char rr, digit;
+    bool commutes;
+};
+
+static const Alu ADD = { 0x01, 0, true };
+static const Alu OR  = { 0x09, 1, true };
+static const Alu AND = { 0x21, 4, true };
+static const Alu SUB = { 0x29, 5, false };
+static const Alu XOR = { 0x31, 6, true };
+static const Alu CMP = { 0x39, 7, false };
+
+// condition codes for jcc
+#define CCZ 0x4
+#define CCGE 0xd
+
+class Emitter {
+public:
+    vector<unsigned char> out;
+
+    void byte(int b) { out.push_back(b); }
+    void imm32(int v) {
+        for (int i = 0; i < 4; ++i) byte((static_cast<unsigned>(v) >> (8 * i)) & 0xff);
+    }
+    void rex(bool w, int reg, int rm) {
+        int r = (w ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0);
+        if (r) byte(0x40 | r);
+    }
+    // reg and [base + disp], base never rsp or r12
+    void mem(int reg, int base, int disp) {
+        if (disp >= -128 && disp < 128) {
+            byte(0x40 | (reg & 7) << 3 | (base & 7));
+            byte(disp & 0xff);
+        } else {
+            byte(0x80 | (reg & 7) << 3 | (base & 7));
+            imm32(disp);
+        }
+    }
+    void movrr(int dst, int src) {
+        if (dst == src) return;
+        rex(false, src, dst);
+        byte(0x89);
+        byte(0xc0 | (src & 7) << 3 | (dst & 7));
+    }
+    void movri(int dst, int v) {
+        rex(false, 0, dst);
+        byte(0xb8 | (dst & 7));
+        imm32(v);
+    }
+    void load(int dst, int base, int disp) {
+        rex(false, dst, base);
+        byte(0x8b);
+        mem(dst, base, disp);
+    }
+    void store(int base, int disp, int src) {
+        rex(false, src, base);
+        byte(0x89);
+        mem(src, base, disp);
+    }
+    void storei(int base, int disp, int v) {
+        rex(false, 0, base);
+        byte(0xc7);
+        mem(0, base, disp);
+        imm32(v);
+    }
+    void alurr(const Alu &op, int dst, int src) {
+        rex(false, src, dst);
+        byte(op.rr);
+        byte(0xc0 | (src & 7) << 3 | (dst & 7));
+    }
+    void alui(const Alu &op, int dst, int v, bool w = false) {
+        rex(w, 0, dst);
+        byte(0x81);
+        byte(0xc0 | op.digit << 3 | (dst & 7));
+        imm32(v);
+    }
+    // shl r, k then sar r, k: sign-extend the low 32 - k bits
+    void narrow(int r, int k) {
+        rex(false, 0, r);
+        byte(0xc1);
+        byte(0xe0 | (r & 7));
+        byte(k);
+        rex(false, 0, r);
+        byte(0xc1);
+        byte(0xf8 | (r & 7));
+        byte(k);
+    }
+    void test(int r) {
+        rex(false, r, r);
+        byte(0x85);
+        byte(0xc0 | (r & 7) << 3 | (r & 7));
+    }
+    void mov64(int dst, int src) {
+        rex(true, src, dst);
+        byte(0x89);
+        byte(0xc0 | (src & 7) << 3 | (dst & 7));
+    }
+    void load64(int dst, int base, int disp) {
+        rex(true, dst, base);
+        byte(0x8b);
+        mem(dst, base, disp);
+    }
+    void store64(int base, int disp, int src) {
+        rex(true, src, base);
+        byte(0x89);
+        mem(src, base, disp);
+    }
+    // jumps with a rel32 to fill in with patch(); both return where it is
+    size_t jcc(int cc) {
+        byte(0x0f);
+        byte(0x80 | cc);
+        imm32(0);
+        return out.size() - 4;
+    }
+    size_t jmp() {
+        byte(0xe9);
+        imm32(0);
+        return out.size() - 4;
+    }
+    void patch(size_t at, size_t target) {
+        setImm(at, static_cast<int>(target - (at + 4)));
+    }
+    void setImm(size_t at, int v) {
+        for (int i = 0; i < 4; ++i) out[at + i] = (static_cast<unsigned>(v) >> (8 * i)) & 0xff;
+    }
+    void call(const void *fn) {
+        byte(0x48);
+        byte(0xb8);
+        unsigned long long a = reinterpret_cast<unsigned long long>(fn);
+        for (int i = 0; i < 8; ++i) byte((a >> (8 * i)) & 0xff);
+        byte(0xff);
+        byte(0xd0);
+    }
+    void push(int r) {
+        rex(false, 0, r);
+        byte(0x50 | (r & 7));
+    }
+    void pop(int r) {
+        rex(false, 0, r);
+        byte(0x58 | (r & 7));
+    }
+};
+
+// One data stack entry while compiling: a register or a constant.
+struct Val {
+    bool reg;
+    int v;
+};
+
+// Entries at positions below base, relative to the depth on entry, are
+// in memory; those from base up are in vals. Return stack entries
+// always go through memory.
+class Compiler {
+public:
+    Emitter e;
+
+    // 32 less the word width
+    int shift;
+
+    explicit Compiler(int bits) : shift(32 - bits), base(0), rtop(0), used(0) {}
+
+    int depth() const { return base + vals.size(); }
+    int rdepth() const { return rtop; }
+    // start a block at depths d and r, every entry in memory
+    void enter(int d, int r) {
+        vals.clear();
+        base = d;
+        rtop = r;
+        used = 0;
+    }
+
+    void push(Val v) { vals.push_back(v); }
+    Val pop() {
+        if (!vals.empty()) {
+            Val v = vals.back();
+            vals.pop_back();
+            return v;
+        }
+        --base;
+        Val v = fresh();
+        e.load(v.v, RBX, 4 * base);
+        return v;
+    }
+    Val fresh() {
+        Val v = { true, alloc() };
+        return v;
+    }
+    Val constant(int k) {
+        Val v = { false, k };
+        return v;
+    }
+    int narrow(unsigned k) const {
+        return static_cast<int>(k << shift) >> shift;
+    }
+    Val copy(Val v) {
+        if (!v.reg) return v;
+        Val c = fresh();
+        e.movrr(c.v, v.v);
+        return c;
+    }
+    void drop(Val v) {
+        if (v.reg) used &= ~(1 << v.v);
+    }
+    // register holding v, loading a constant if need be
+    int inReg(Val v) {
+        if (v.reg) return v.v;
+        int r = alloc();
+        e.movri(r, v.v);
+        return r;
+    }
+
+    void alu(const Alu &op) {
+        Val b = pop(), a = pop();
+        if (!a.reg && !b.reg) {
+            unsigned x = a.v, y = b.v;
+            if (&op == &ADD) x += y;
+            else if (&op == &SUB) x -= y;
+            else if (&op == &AND) x &= y;
+            else if (&op == &OR) x |= y;
+            else x ^= y;
+            push(constant(narrow(x)));
+        } else if (!a.reg && op.commutes) {
+            e.alui(op, b.v, a.v);
+            wrap(op, b.v);
+            push(b);
+        } else {
+            int r = inReg(a);
+            if (b.reg) e.alurr(op, r, b.v);
+            else e.alui(op, r, b.v);
+            wrap(op, r);
+            drop(b);
+            Val v = { true, r };
+            push(v);
+        }
+    }
+    // + and - wrap at the word width; the logical ops cannot leave it
+    void wrap(const Alu &op, int r) {
+        if (shift && (&op == &ADD || &op == &SUB)) e.narrow(r, shift);
+    }
+
+    void toR(Val v) {
+        if (v.reg) e.store(RBP, 4 * rtop, v.v);
+        else e.storei(RBP, 4 * rtop, v.v);
+        ++rtop;
+        drop(v);
+    }
+    Val fromR() {
+        --rtop;
+        Val v = fresh();
+        e.load(v.v, RBP, 4 * rtop);
+        // return addresses may be wider than data
+        if (shift) e.narrow(v.v, shift);
+        return v;
+    }
+    void rload(int dst) {
+        --rtop;
+        e.load(dst, RBP, 4 * rtop);
+    }
+
+    // write every entry back to memory
+    void flush() {
+        for (auto&& v : vals) {
+            if (v.reg) e.store(RBX, 4 * base, v.v);
+            else e.storei(RBX, 4 * base, v.v);
+            drop(v);
+            ++base;
+        }
+        vals.clear();
+    }
+
+private:
+    vector<Val> vals;
+    int base;
+    int rtop;
+    unsigned used;
+
+    int alloc() {
+        for (;;) {
+            for (int i = 0; i < NVALUEREGS; ++i) {
+                int r = valueRegs[i];
+                if (!(used & (1 << r))) {
+                    used |= 1 << r;
+                    return r;
+                }
+            }
+            // spill the bottom entry
+            Val v = vals.front();
+            if (v.reg) e.store(RBX, 4 * base, v.v);
+            else e.storei(RBX, 4 * base, v.v);
+            drop(v);
+            vals.erase(vals.begin());
+            ++base;
+        }
+    }
+};
+
+JitCompiler::JitCompiler() {
+}
+
+JitCompiler::~JitCompiler() {
+    clear();
+}
+
+bool JitCompiler::supported() {
+    return true;
+}
+
+bool JitCompiler::compile(const function<int(int)> &read, const vector<Block> &region, FetchCode fetch,
+                          int bits, NativeBlock *out) {
+    Compiler j(bits);
+    Emitter &e = j.e;
+    // five pushes leave the stack 16-byte aligned for calls
+    e.push(RBX);
+    e.push(RBP);
+    e.push(R12);
+    e.push(R13);
+    e.push(R14);
+    e.mov64(RBX, RDI);
+    e.mov64(RBP, RSI);
+    e.mov64(R12, RDX);
+    e.mov64(R14, RCX);
+    e.load64(R13, R14, offsetof(NativeExit, budget));
+
+    // per block of the region: depths on entry, once reached, where its
+    // code starts and the instructions it runs natively
+    size_t nb = region.size();
+    vector<char> seen(nb, 0);
+    vector<int> dent(nb, 0), rent(nb, 0), count(nb, 0);
+    vector<size_t> at(nb, 0);
+    vector<pair<size_t, int> > jumps;
+    vector<size_t> exits;
+    vector<int> work(1, 0);
+    seen[0] = 1;
+    // whether a jump goes back to a block at or before its own, so the
+    // region holds a loop; others cost more to enter than they save
+    int from = 0;
+    bool loops = false;
+
+    // return pc, in rax already if inRax, to the caller
+    auto leave = [&](bool inRax, int pc, int d, int r) {
+        if (!inRax) e.movri(RAX, pc);
+        e.storei(R14, offsetof(NativeExit, ddelta), d);
+        e.storei(R14, offsetof(NativeExit, rdelta), r);
+        exits.push_back(e.jmp());
+    };
+    // carry on at pc with every entry in memory: in the region if pc
+    // starts one of its blocks entered at these depths, else leave
+    auto edge = [&](int pc) {
+        int d = j.depth(), r = j.rdepth();
+        for (size_t k = 0; k < nb; ++k) {
+            if (region[k].start != pc) continue;
+            if (seen[k] && (dent[k] != d || rent[k] != r)) break;
+            if (pc <= from) loops = true;
+            if (!seen[k]) {
+                seen[k] = 1;
+                dent[k] = d;
+                rent[k] = r;
+                work.push_back(k);
+            }
+            jumps.push_back(make_pair(e.jmp(), (int) k));
+            return;
+        }
+        leave(false, pc, d, r);
+    };
+
+    for (size_t w = 0; w < work.size(); ++w) {
+        int k = work[w];
+        const Block &b = region[k];
+        at[k] = e.out.size();
+        from = b.start;
+        j.enter(dent[k], rent[k]);
+        // a block the budget cannot cover is left to the caller; the
+        // instruction count is filled in once the block is compiled
+        e.alui(CMP, R13, 0, true);
+        size_t cmpAt = e.out.size() - 4;
+        size_t fits = e.jcc(CCGE);
+        leave(false, b.start, dent[k], rent[k]);
+        e.patch(fits, e.out.size());
+        e.alui(SUB, R13, 0, true);
+        size_t subAt = e.out.size() - 4;
+
+        int a = b.start;
+        bool done = false;
+        while (a < b.end && !done) {
+            int opc = read(a);
+            Val x, y, z;
+            switch (opc) {
+            case 0xff00:
+                j.push(j.constant(j.narrow(read(a + 1))));
+                break;
+            case 0xff01:
+                x = j.pop();
+                j.flush();
+                if (x.reg) e.movrr(RSI, x.v);
+                else e.movri(RSI, x.v);
+                j.drop(x);
+                e.mov64(RDI, R12);
+                e.call(reinterpret_cast<const void *>(fetch));
+                x = j.fresh();
+                e.movrr(x.v, RAX);
+                j.push(x);
+                break;
+            case 0xff03:
+                j.drop(j.pop());
+                break;
+            case 0xff04:
+                x = j.pop();
+                y = j.copy(x);
+                j.push(x);
+                j.push(y);
+                break;
+            case 0xff05:
+                y = j.pop();
+                x = j.pop();
+                z = j.copy(x);
+                j.push(x);
+                j.push(y);
+                j.push(z);
+                break;
+            case 0xff06:
+                y = j.pop();
+                x = j.pop();
+                j.push(y);
+                j.push(x);
+                break;
+            case 0xff07: j.alu(ADD); break;
+            case 0xff08: j.alu(SUB); break;
+            case 0xff09: j.alu(AND); break;
+            case 0xff0a: j.alu(OR); break;
+            case 0xff0b: j.alu(XOR); break;
+            case 0xff0c:
+                x = j.pop();
+                j.flush();
+                if (!x.reg) {
+                    edge(x.v ? a + 2 : read(a + 1));
+                } else {
+                    e.test(x.v);
+                    j.drop(x);
+                    size_t taken = e.jcc(CCZ);
+                    edge(a + 2);
+                    e.patch(taken, e.out.size());
+                    edge(read(a + 1));
+                }
+                done = true;
+                break;
+            case 0xff0d:
+                j.flush();
+                j.toR(j.constant(a + 2));
+                edge(read(a + 1));
+                done = true;
+                break;
+            case 0xff0e:
+                j.flush();
+                j.rload(RAX);
+                leave(true, 0, j.depth(), j.rdepth());
+                done = true;
+                break;
+            case 0xff10:
+                j.toR(j.pop());
+                break;
+            case 0xff11:
+                j.push(j.fromR());
+                break;
+            default:
+                // store and HALT run in the caller
+                j.flush();
+                leave(false, a, j.depth(), j.rdepth());
+                done = true;
+                continue;
+            }
+            ++count[k];
+            if (!done) a += opGetPci(opc);
+        }
+        if (!done) {
+            j.flush();
+            edge(a);
+        }
+        e.setImm(cmpAt, count[k]);
+        e.setImm(subAt, count[k]);
+    }
+
+    size_t epilogue = e.out.size();
+    e.store64(R14, offsetof(NativeExit, budget), R13);
+    e.pop(R14);
+    e.pop(R13);
+    e.pop(R12);
+    e.pop(RBP);
+    e.pop(RBX);
+    e.byte(0xc3);
+    for (auto&& x : exits) e.patch(x, epilogue);
+    for (auto&& x : jumps) e.patch(x.first, at[x.second]);
+
+    // the region's figures cover each block at the depths it is entered
+    int total = 0;
+    NativeBlock nbk = { NULL, count[0], 0, 0, 0, 0 };
+    for (size_t k = 0; k < nb; ++k) {
+        if (!seen[k]) continue;
+        const Block &b = region[k];
+        total += count[k];
+        nbk.dneed = max(nbk.dneed, b.dneed - dent[k]);
+        nbk.dgrow = max(nbk.dgrow, dent[k] + b.dgrow);
+        nbk.rneed = max(nbk.rneed, b.rneed - rent[k]);
+        nbk.rgrow = max(nbk.rgrow, rent[k] + b.rgrow);
+    }
+    // the caller must get at least one instruction run for its call
+    if (!loops || count[0] < 1 || total < 2) return false;
+
+    size_t n = e.out.size();
+    if (chunks.empty() || chunks.back().size - chunks.back().used < n) {
+        size_t size = n > CHUNKSIZE ? (n + CHUNKSIZE - 1) & ~(size_t) (CHUNKSIZE - 1) : CHUNKSIZE;
+        void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) return false;
+        Chunk c = { static_cast<unsigned char *>(m), size, 0 };
+        chunks.push_back(c);
+    } else if (mprotect(chunks.back().mem, chunks.back().size, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    Chunk &c = chunks.back();
+    unsigned char *code = c.mem + c.used;
+    memcpy(code, e.out.data(), n);
+    c.used = (c.used + n + 15) & ~(size_t) 15;
+    if (mprotect(c.mem, c.size, PROT_READ | PROT_EXEC) != 0) return false;
+
+    *out = nbk;
+    out->code = reinterpret_cast<NativeCode>(code);
+    return true;
+}
+
+void JitCompiler::clear() {
+    for (auto&& c : chunks) munmap(c.mem, c.size);
+    chunks.clear();
+}
+
+#else
+
+JitCompiler::JitCompiler() {
+}
+
+JitCompiler::~JitCompiler() {
+}
+
+bool JitCompiler::supported() {
+    return false;
+}
+
+bool JitCompiler::compile(const function<int(int)> &, const vector<Block> &, FetchCode, int, NativeBlock *) {
+    return false;
+}
+
+void JitCompiler::clear() {
+}
+
+#endif
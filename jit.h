@@ -0,0 +1,91 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <functional>
+#include <vector>
+#include "verifier.h"
+
+using namespace std;
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_X64
+#endif
+
+// How a native region left off: on entry the instructions it may run,
+// on exit those left, and how far it moved the two stacks.
+struct NativeExit {
+    long long budget;
+    int ddelta, rdelta;
+};
+
+// Native code for a region, called with the data and return stacks at
+// their depths on entry; returns the next PC. The region's stack
+// figures must have been checked against those depths, and the budget
+// must cover the first block.
+typedef int (*NativeCode)(int *ds, int *rs, const void *ctx, NativeExit *x);
+// memory read used by @, called with the ctx given to NativeCode
+typedef int (*FetchCode)(const void *ctx, int addr);
+
+struct NativeBlock {
+    NativeCode code;
+    // instructions of the first block, stack figures of the region as
+    // a Block has them
+    int count;
+    int dneed, dgrow, rneed, rgrow;
+};
+
+// Compiles regions to x86-64 (System V) into executable memory it
+// owns. A region is the block it starts at and the blocks of the given
+// set that jump or run on to one another from it, each entered at the
+// same stack depths on every path, so a loop among them runs without
+// leaving native code. A region without a loop is not compiled, as
+// entering it costs more than it saves. Each block is compiled up to
+// its final jump, or up to a store or HALT, which are left for the
+// caller; control that leaves the region returns to the caller, as
+// does a block the budget cannot cover. Stack entries are kept in
+// registers or as constants within a block and written back at its
+// end. Values are bits wide and kept sign-extended, as the CPU keeps
+// them.
+class JitCompiler {
+public:
+    JitCompiler();
+    ~JitCompiler();
+    static bool supported();
+    bool compile(const function<int(int)> &read, const vector<Block> &region, FetchCode fetch, int bits,
+                 NativeBlock *out);
+    void clear();
+
+private:
+    struct Chunk {
+        unsigned char *mem;
+        size_t size, used;
+    };
+
+    vector<Chunk> chunks;
+
+    JitCompiler(const JitCompiler &);
+    JitCompiler &operator=(const JitCompiler &);
+};
+
+#endif // JIT_H
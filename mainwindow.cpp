@@ -21,32 +21,68 @@
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 #include "stackcpu.h"
+#include "memorymodel.h"
 #include <QMessageBox>
 #include <QFontDialog>
+#include <QStatusBar>
+#include <QTextBlock>
 #include <QTimer>
 
 #define APPTITLE "Stack CPU"
 #define HEXFORMAT "x%1 (%2)"
-#define MEMFORMAT "x%1: %2"
 #define COMPILEER "Compile error at address x%1: %2"
+#define COMPILELN "Compile error at line %3, address x%1: %2"
 #define RUNTIMEER "Runtime error at address x%1: %2"
+#define STACKWARN "Stack error ahead at address x%1: %2"
+#define NOERRORS "No errors"
 
 int strToBlock(QString s) {
     int i = s.indexOf(' ');
     return s.left(i).toInt();
 }
 
-StackCPU *stackcpu;
-int len;
+string blockText(const QTextBlock &b) {
+    QByteArray t = b.text().toLatin1();
+    return string(t.constData(), t.size());
+}
+
+vector<string> documentLines(const QTextDocument *doc) {
+    vector<string> lines;
+    for (QTextBlock b = doc->begin(); b.isValid(); b = b.next()) lines.push_back(blockText(b));
+    return lines;
+}
 
 MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::MainWindow) {
     ui->setupUi(this);
     stackcpu = new StackCPU();
+    checker = new StackCPU();
+    vector<string> lines = documentLines(ui->edtCode->document());
+    stackcpu->setLines(lines);
+    checker->setLines(lines);
+    linesStale = false;
+    setRunning(false);
     len = 2;
+    connect(ui->edtCode->document(), SIGNAL(contentsChange(int,int,int)),
+            this, SLOT(codeChanged(int,int,int)));
+
+    memModel = new MemoryModel(stackcpu, this);
+    ui->lstMem->setModel(memModel);
+
+    worker = new CpuWorker(stackcpu);
+    worker->moveToThread(&thread);
+    connect(this, SIGNAL(runRequested()), worker, SLOT(start()));
+    connect(worker, SIGNAL(progress(CpuState)), this, SLOT(showState(CpuState)));
+    connect(worker, SIGNAL(finished(bool)), this, SLOT(runFinished(bool)));
+    connect(&thread, SIGNAL(finished()), worker, SLOT(deleteLater()));
+    thread.start();
 }
 
 MainWindow::~MainWindow() {
+    worker->stop();
+    thread.quit();
+    thread.wait();
     delete stackcpu;
+    delete checker;
     delete ui;
 }
 
@@ -64,22 +100,14 @@ void MainWindow::raiseHaltMessage() {
 }
 
 void MainWindow::reloadStack() {
-    ui->lstDS->clear();
-    ui->lstRS->clear();
+    showState(CpuWorker::capture(stackcpu));
+}
 
-    vector<int> tmp = stackcpu->dataStack();
-    foreach(unsigned char t, tmp) {
-        ui->lstDS->addItem(QString(HEXFORMAT).arg(QString::number(t, 16).toUpper(), 2, QChar('0'))\
-            .arg(static_cast<signed char>(t)));
-    }
+void MainWindow::showState(const CpuState &state) {
+    setStackItems(ui->lstDS, state.ds);
+    setStackItems(ui->lstRS, state.rs);
 
-    tmp = stackcpu->returnStack();
-    foreach(unsigned char t, tmp) {
-        ui->lstRS->addItem(QString(HEXFORMAT).arg(QString::number(t, 16).toUpper(), 2, QChar('0'))\
-            .arg(static_cast<signed char>(t)));
-    }
-
-    int pc = stackcpu->pc();
+    int pc = state.pc;
 
     ui->lblPC->setText(QString(HEXFORMAT).arg(QString::number(pc, 16).toUpper(), len, QChar('0'))\
         .arg(pc));
@@ -90,43 +118,32 @@ void MainWindow::reloadStack() {
 //    ui->lstDS->scrollToBottom();
 //    ui->lstRS->scrollToBottom();
 
-    QBrush brush = ui->lstMem->palette().brush(QPalette::Active, QPalette::Base);
-
-    for (int i = 0; i < ui->lstMem->count(); ++i) {
-        ui->lstMem->item(i)->setBackground(brush);
-    }
-
-    brush = ui->lstMem->palette().brush(QPalette::Active, QPalette::Highlight);
-
-    if (pc >= 0 && pc < ui->lstMem->count()) {
-        ui->lstMem->item(pc)->setSelected(true);
-        ui->lstMem->item(pc)->setBackground(brush);
+    memModel->setPc(pc);
+    if (pc >= 0 && pc < memModel->rowCount()) {
+        ui->lstMem->setCurrentIndex(memModel->index(pc));
     }
 }
 
-void MainWindow::reloadMemory() {
-    QString t;
-    int l = stackcpu->getMemSize();
-
-    // resize list
-    while (ui->lstMem->count() < l) {
-        ui->lstMem->addItem("");
+// update the stack list in place, touching only entries that changed
+void MainWindow::setStackItems(QListWidget *lst, const QVector<int> &v) {
+    while (lst->count() > v.size()) {
+        delete lst->takeItem(lst->count() - 1);
     }
-
-    len = QString::number(l - 1, 16).length();
-
-    for (int i = 0; i < l; ++i) {
-        int m = stackcpu->memory(i);
-        int p = opGetCode(m);
-        t = QString::fromStdString(opGetOps(m));
-        if (p == 0xffff || t == "") {
-            unsigned char r = static_cast<unsigned char>(m);
-            t = QString(HEXFORMAT).arg(QString::number(r, 16).toUpper(), 2, QChar('0')).arg(static_cast<signed char>(r));
+    for (int i = 0; i < v.size(); ++i) {
+        QString s = wordText(v[i], stackcpu->getWordBits());
+        if (i >= lst->count()) {
+            lst->addItem(s);
+        } else if (lst->item(i)->text() != s) {
+            lst->item(i)->setText(s);
         }
-        ui->lstMem->item(i)->setText(QString(MEMFORMAT).arg(QString::number(i, 16).toUpper(), len, QChar('0')).arg(t));
     }
 }
 
+void MainWindow::reloadMemory() {
+    memModel->refresh();
+    len = QString::number(stackcpu->getMemSize() - 1, 16).length();
+}
+
 void MainWindow::on_btnReset_clicked() {
     stackcpu->clearStack();
     reloadStack();
@@ -144,42 +161,148 @@ void MainWindow::on_btnFont_clicked() {
     }
 }
 
+QString MainWindow::compileMessage(const StackCPU *cpu) const {
+    int w = QString::number(cpu->getMemSize() - 1, 16).length();
+    QString msg = QString(cpu->errorLine() > 0 ? COMPILELN : COMPILEER)
+        .arg(QString::number(cpu->errorAddr(), 16).toUpper(), w, QChar('0'))
+        .arg(QString::fromStdString(cpu->error()));
+    if (cpu->errorLine() > 0) msg = msg.arg(cpu->errorLine());
+    return msg;
+}
+
 void MainWindow::on_btnCompile_clicked() {
-    ui->lstMem->clear();
     stackcpu->setMemSize(strToBlock(ui->cmbMemSize->currentText()));
-    vector<string> lst;
-    QStringList slst = ui->edtCode->toPlainText().split("\n");
-    for (int i = 0; i < slst.count(); ++i) {
-        string tmp = "";
-        QString st = slst[i];
-        for (int j = 0; j < st.length(); ++j) {
-            tmp += st[j].toLatin1();
-        }
-        lst.push_back(tmp);
+    stackcpu->setWordBits(strToBlock(ui->cmbWordBits->currentText()));
+    if (linesStale) {
+        stackcpu->setLines(*checker->getLines());
+        linesStale = false;
     }
-    stackcpu->setLines(lst);
     if (stackcpu->compile()) {
         stackcpu->clearStack();
         reloadMemory();
         reloadStack();
+        QStringList warn;
+        for (auto&& d : stackcpu->diagnostics()) {
+            warn << QString(STACKWARN)
+                .arg(QString::number(d.addr, 16).toUpper(), len, QChar('0'))
+                .arg(QString::fromStdString(d.message));
+        }
+        if (!warn.isEmpty()) QMessageBox::warning(this, APPTITLE, warn.join("\n"));
+    } else {
+        QMessageBox::critical(this, APPTITLE, compileMessage(stackcpu));
+    }
+}
+
+// Hands the lines an edit touched to both CPUs, so that compiling
+// assembles only those. The lines it replaced are as many as it spans
+// now, less the lines it added.
+void MainWindow::codeChanged(int pos, int removed, int added) {
+    Q_UNUSED(removed);
+    const QTextDocument *doc = ui->edtCode->document();
+    QTextBlock b = doc->findBlock(pos);
+    QTextBlock e = doc->findBlock(pos + added);
+    if (!e.isValid()) e = doc->lastBlock();
+    int first = b.blockNumber();
+    int span = e.blockNumber() - first + 1;
+    int count = span + static_cast<int>(checker->getLines()->size()) - doc->blockCount();
+    if (!b.isValid() || count < 0 || first + count > static_cast<int>(checker->getLines()->size())) {
+        checker->setLines(documentLines(doc));
+        linesStale = true;
+    } else {
+        vector<string> with;
+        for (QTextBlock i = b; i.isValid() && i.blockNumber() <= e.blockNumber(); i = i.next()) {
+            with.push_back(blockText(i));
+        }
+        checker->replaceLines(first, count, with);
+        if (running) linesStale = true;
+        else if (!linesStale) stackcpu->replaceLines(first, count, with);
+    }
+    if (ui->chkLive->isChecked()) liveCheck();
+}
+
+// Compiles the editor text on its own CPU and shows the first error or
+// warning in the status bar.
+void MainWindow::liveCheck() {
+    checker->setMemSize(strToBlock(ui->cmbMemSize->currentText()));
+    checker->setWordBits(strToBlock(ui->cmbWordBits->currentText()));
+    if (!checker->compile()) {
+        statusBar()->showMessage(compileMessage(checker));
+    } else if (!checker->diagnostics().empty()) {
+        const Diagnostic &d = checker->diagnostics().front();
+        int w = QString::number(checker->getMemSize() - 1, 16).length();
+        statusBar()->showMessage(QString(STACKWARN)
+            .arg(QString::number(d.addr, 16).toUpper(), w, QChar('0'))
+            .arg(QString::fromStdString(d.message)));
     } else {
-        QMessageBox::critical(
-            this,
-            APPTITLE,
-            QString(COMPILEER)
-                .arg(QString::number(stackcpu->errorAddr(), 16).toUpper(), len, QChar('0'))\
-                .arg(QString::fromStdString(stackcpu->error())));
+        statusBar()->showMessage(tr(NOERRORS));
     }
 }
 
+void MainWindow::on_chkLive_toggled(bool checked) {
+    if (checked) liveCheck();
+    else statusBar()->clearMessage();
+}
+
+// Stepping back needs the journal, which keeps Run off the fast
+// engines, so it is only recorded while asked for.
+void MainWindow::on_chkJournal_toggled(bool checked) {
+    stackcpu->setJournal(checked);
+    setRunning(running);
+}
+
+void MainWindow::on_cmbMemSize_currentIndexChanged(int index) {
+    Q_UNUSED(index);
+    if (ui->chkLive->isChecked()) liveCheck();
+}
+
+void MainWindow::on_cmbWordBits_currentIndexChanged(int index) {
+    Q_UNUSED(index);
+    if (ui->chkLive->isChecked()) liveCheck();
+}
+
+// The CPU runs on the worker thread and must not be touched here until
+// runFinished(); progress arrives through showState().
 void MainWindow::on_btnRun_clicked() {
-    bool r = stackcpu->run();
+    setRunning(true);
+    worker->arm();
+    emit runRequested();
+}
+
+void MainWindow::on_btnPause_clicked() {
+    worker->pause();
+}
+
+void MainWindow::on_btnStop_clicked() {
+    worker->stop();
+}
+
+void MainWindow::runFinished(bool ok) {
+    setRunning(false);
     reloadStack();
     reloadMemory();
-    if (!r) raiseRuntimeError();
+    if (!ok) raiseRuntimeError();
+}
+
+void MainWindow::setRunning(bool r) {
+    running = r;
+    ui->btnCompile->setEnabled(!r);
+    ui->chkJournal->setEnabled(!r);
+    ui->btnRunBack->setEnabled(!r && ui->chkJournal->isChecked());
+    ui->btnBack->setEnabled(!r && ui->chkJournal->isChecked());
+    ui->btnOver->setEnabled(!r);
+    ui->btnInto->setEnabled(!r);
+    ui->btnRun->setEnabled(!r);
+    ui->btnReset->setEnabled(!r);
+    ui->btnPause->setEnabled(r);
+    ui->btnStop->setEnabled(r);
 }
 
 void MainWindow::on_btnInto_clicked() {
+    // a failed step leaves the CPU where it failed; step back or reset
+    if (stackcpu->stopReason() == StackCPU::StopError) {
+        raiseRuntimeError();
+        return;
+    }
     if (!stackcpu->halt()) {
         bool r = stackcpu->stepInto();
         reloadStack();
@@ -190,6 +313,10 @@ void MainWindow::on_btnInto_clicked() {
 }
 
 void MainWindow::on_btnOver_clicked() {
+    if (stackcpu->stopReason() == StackCPU::StopError) {
+        raiseRuntimeError();
+        return;
+    }
     if (!stackcpu->halt()) {
         bool r = stackcpu->stepOver();
         reloadStack();
@@ -199,9 +326,22 @@ void MainWindow::on_btnOver_clicked() {
     if (stackcpu->halt()) raiseHaltMessage();
 }
 
-void MainWindow::on_lstMem_itemSelectionChanged() {
-    int pc = stackcpu->pc();
-    if (pc >= 0 && pc < ui->lstMem->count()) {
-        ui->lstMem->setCurrentRow(pc);
-    }
+void MainWindow::on_btnBack_clicked() {
+    stackcpu->stepBack();
+    reloadStack();
+    reloadMemory();
+}
+
+void MainWindow::on_btnRunBack_clicked() {
+    stackcpu->runBack();
+    reloadStack();
+    reloadMemory();
+}
+
+void MainWindow::on_lstMem_doubleClicked(const QModelIndex &index) {
+    if (running) return;
+    int i = index.row();
+    if (stackcpu->hasBreakpoint(i)) stackcpu->clearBreakpoint(i);
+    else stackcpu->setBreakpoint(i);
+    memModel->touch(i);
 }
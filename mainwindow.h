@@ -22,6 +22,12 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QThread>
+#include "cpuworker.h"
+
+class StackCPU;
+class MemoryModel;
+class QListWidget;
 
 namespace Ui {
 class MainWindow;
@@ -38,17 +44,46 @@ private slots:
     void on_btnReset_clicked();
     void on_btnFont_clicked();
     void on_btnCompile_clicked();
+    void on_chkLive_toggled(bool checked);
+    void on_chkJournal_toggled(bool checked);
+    void on_cmbMemSize_currentIndexChanged(int index);
+    void on_cmbWordBits_currentIndexChanged(int index);
+    void codeChanged(int pos, int removed, int added);
     void on_btnRun_clicked();
     void on_btnInto_clicked();
     void on_btnOver_clicked();
-    void on_lstMem_itemSelectionChanged();
+    void on_btnBack_clicked();
+    void on_btnRunBack_clicked();
+    void on_lstMem_doubleClicked(const QModelIndex &index);
+    void on_btnPause_clicked();
+    void on_btnStop_clicked();
+    void showState(const CpuState &state);
+    void runFinished(bool ok);
+
+signals:
+    void runRequested();
 
 private:
     Ui::MainWindow *ui;
+    StackCPU *stackcpu;
+    // compiles the editor text as it changes, for live diagnostics;
+    // stackcpu keeps the program being debugged until Compile
+    StackCPU *checker;
+    // stackcpu missed edits made while it was running
+    bool linesStale;
+    MemoryModel *memModel;
+    CpuWorker *worker;
+    QThread thread;
+    bool running;
+    int len;
+    QString compileMessage(const StackCPU *cpu) const;
+    void liveCheck();
     void raiseRuntimeError();
     void raiseHaltMessage();
     void reloadStack();
     void reloadMemory();
+    void setStackItems(QListWidget *lst, const QVector<int> &v);
+    void setRunning(bool r);
 };
 
 #endif // MAINWINDOW_H
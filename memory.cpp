@@ -0,0 +1,170 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#include "memory.h"
+#include <algorithm>
+#include <cstring>
+
+Memory::Memory() {
+    base = NULL;
+    tags = NULL;
+    extent = 0;
+    n = 0;
+}
+
+Memory::~Memory() {
+    clearTables();
+    for (auto&& p : pool) delete[] p;
+}
+
+shared_ptr<const Image> Memory::image() const {
+    return img;
+}
+
+int Memory::pageWords(int p) const {
+    long long e = static_cast<long long>(p + 1) << PAGESHIFT;
+    return static_cast<int>(min(e, static_cast<long long>(n)) - (p << PAGESHIFT));
+}
+
+// Give page p its own storage, filled from the image along with its
+// tags, and mark it dirty.
+int *Memory::touch(int p) {
+    int **&t = dir[p >> TABLESHIFT];
+    if (!t) t = new int *[TABLESIZE]();
+    int *w;
+    if (pool.empty()) {
+        w = new int[PAGESIZE + PAGETAGS];
+    } else {
+        w = pool.back();
+        pool.pop_back();
+    }
+    int b = p << PAGESHIFT;
+    int k = max(0, min(PAGESIZE, extent - b));
+    if (k) memcpy(w, base + b, k * sizeof(int));
+    memset(w + k, 0, (PAGESIZE + PAGETAGS - k) * sizeof(int));
+    if (tags) {
+        for (int i = 0; i < k; ++i) {
+            if (tags[(b + i) >> 3] >> ((b + i) & 7) & 1) w[PAGESIZE + i / 32] |= 1u << (i & 31);
+        }
+    }
+    t[p & TABLEMASK] = w;
+    dirtyList.push_back(p);
+    return w;
+}
+
+// Drop the storage of page p so it reads from the image again.
+void Memory::release(int p) {
+    int *&w = dir[p >> TABLESHIFT][p & TABLEMASK];
+    pool.push_back(w);
+    w = NULL;
+}
+
+void Memory::clearTables() {
+    for (auto&& p : dirtyList) release(p);
+    dirtyList.clear();
+    for (auto&& t : dir) delete[] t;
+    dir.clear();
+}
+
+// Reset to the contents of img. Loading the image already in use only
+// drops the pages written since, which are appended to restored.
+void Memory::load(shared_ptr<const Image> img, vector<int> *restored) {
+    if (this->img == img) {
+        for (auto&& p : dirtyList) {
+            release(p);
+            if (restored) restored->push_back(p);
+        }
+        dirtyList.clear();
+        return;
+    }
+    clearTables();
+    this->img = img;
+    n = img->size();
+    base = img->data();
+    tags = img->tags();
+    extent = img->extent();
+    dir.assign(((n - 1) >> (PAGESHIFT + TABLESHIFT)) + 1, NULL);
+}
+
+// Make the word at addr run as an instruction if its page holds code,
+// so a program can write new code over its operands and data. Pages
+// without an opcode stay data.
+void Memory::retag(int addr) {
+    if (!tags || addr < 0 || addr >= n) return;
+    int p = addr >> PAGESHIFT;
+    int **t = dir[p >> TABLESHIFT];
+    int *w = t ? t[p & TABLEMASK] : NULL;
+    if (!w) w = touch(p);
+    bool code = false;
+    for (int i = 0; i < PAGETAGS; ++i) code = code || w[PAGESIZE + i];
+    if (code) w[PAGESIZE + (addr & PAGEMASK) / 32] |= 1u << (addr & 31);
+}
+
+// Make the word at addr data again, undoing retag().
+void Memory::untag(int addr) {
+    if (!tags || addr < 0 || addr >= n) return;
+    int p = addr >> PAGESHIFT;
+    int **t = dir[p >> TABLESHIFT];
+    int *w = t ? t[p & TABLEMASK] : NULL;
+    if (!w) w = touch(p);
+    w[PAGESIZE + (addr & PAGEMASK) / 32] &= ~(1u << (addr & 31));
+}
+
+// Copy out every page that differs from the image, followed in a
+// tagged image by its tags.
+void Memory::save(vector<int> *pages, vector<int> *words) const {
+    pages->clear();
+    words->clear();
+    for (auto&& p : dirtyList) {
+        pages->push_back(p);
+        const int *src = dir[p >> TABLESHIFT][p & TABLEMASK];
+        words->insert(words->end(), src, src + pageWords(p));
+        if (tags) words->insert(words->end(), src + PAGESIZE, src + PAGESIZE + PAGETAGS);
+    }
+}
+
+// Inverse of save(): pages dirty now but not in the snapshot go back
+// to the image, pages in the snapshot take its contents. Every page
+// rewritten is appended to restored. Fails, changing nothing, if the
+// pages are not ones of this memory or the words do not fill them.
+bool Memory::restore(const vector<int> &pages, const vector<int> &words,
+                     vector<int> *restored) {
+    size_t total = 0;
+    for (auto&& p : pages) {
+        if (p < 0 || p > (n - 1) >> PAGESHIFT) return false;
+        total += pageWords(p) + (tags ? PAGETAGS : 0);
+    }
+    if (total != words.size()) return false;
+    load(img, restored);
+    const int *src = words.data();
+    for (auto&& p : pages) {
+        int w = pageWords(p);
+        int *dst = touch(p);
+        memcpy(dst, src, w * sizeof(int));
+        src += w;
+        if (tags) {
+            memcpy(dst + PAGESIZE, src, PAGETAGS * sizeof(int));
+            src += PAGETAGS;
+        }
+        if (restored) restored->push_back(p);
+    }
+    return true;
+}
@@ -0,0 +1,105 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <memory>
+#include <vector>
+#include "image.h"
+
+using namespace std;
+
+#define PAGESHIFT 6
+#define PAGESIZE (1 << PAGESHIFT)
+#define PAGEMASK (PAGESIZE - 1)
+#define TABLESHIFT 12
+#define TABLESIZE (1 << TABLESHIFT)
+#define TABLEMASK (TABLESIZE - 1)
+// ints of opcode tags after the words of a page, a bit per word
+#define PAGETAGS (PAGESIZE / 32)
+
+// CPU memory seeded from an Image. Storage is allocated a page at a
+// time on the first store into it, through a two level page table, so
+// a large address space costs only what the program touches. Untouched
+// pages read straight from the image, and resetting to the image or
+// restoring a snapshot only visits the pages written.
+//
+// A written page of a tagged image keeps its own opcode tags, so a
+// store can make a word code: see retag().
+class Memory {
+public:
+    Memory();
+    ~Memory();
+    void load(shared_ptr<const Image> img, vector<int> *restored = NULL);
+    void save(vector<int> *pages, vector<int> *words) const;
+    bool restore(const vector<int> &pages, const vector<int> &words,
+                 vector<int> *restored = NULL);
+    shared_ptr<const Image> image() const;
+    int size() const { return n; }
+    int read(int addr) const {
+        int **t = dir[addr >> (PAGESHIFT + TABLESHIFT)];
+        const int *p = t ? t[(addr >> PAGESHIFT) & TABLEMASK] : NULL;
+        if (p) return p[addr & PAGEMASK];
+        return addr < extent ? base[addr] : 0;
+    }
+    void write(int addr, int val) {
+        int **t = dir[addr >> (PAGESHIFT + TABLESHIFT)];
+        int *p = t ? t[(addr >> PAGESHIFT) & TABLEMASK] : NULL;
+        if (!p) p = touch(addr >> PAGESHIFT);
+        p[addr & PAGEMASK] = val;
+    }
+    // whether the word at addr may run as an instruction: in a tagged
+    // image, one assembled as an opcode or retagged since; in an
+    // untagged one, any
+    bool instruction(int addr) const {
+        if (!tags) return true;
+        if (static_cast<unsigned>(addr) >= static_cast<unsigned>(n)) return false;
+        int **t = dir[addr >> (PAGESHIFT + TABLESHIFT)];
+        const int *p = t ? t[(addr >> PAGESHIFT) & TABLEMASK] : NULL;
+        if (p) return p[PAGESIZE + (addr & PAGEMASK) / 32] >> (addr & 31) & 1;
+        return addr < extent && (tags[addr >> 3] >> (addr & 7) & 1);
+    }
+    bool tagged() const { return tags != NULL; }
+    void retag(int addr);
+    void untag(int addr);
+    // pages written since the image was loaded, in the order touched
+    const vector<int> &dirty() const { return dirtyList; }
+
+private:
+    shared_ptr<const Image> img;
+    const int *base;
+    const unsigned char *tags;
+    int extent;
+    int n;
+    vector<int **> dir;
+    vector<int> dirtyList;
+    vector<int *> pool;
+
+    Memory(const Memory &);
+    Memory &operator=(const Memory &);
+    int *touch(int p);
+    void release(int p);
+    void clearTables();
+    int pageWords(int p) const;
+};
+
+#endif // MEMORY_H
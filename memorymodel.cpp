@@ -0,0 +1,141 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#include "memorymodel.h"
+#include "stackcpu.h"
+#include <QBrush>
+#include <QGuiApplication>
+#include <QPalette>
+#include <algorithm>
+
+#define HEXFORMAT "x%1 (%2)"
+#define MEMFORMAT "x%1: %2"
+#define BRKFORMAT "x%1:*%2"
+
+// A word as hex at the given width, followed by its signed value.
+QString wordText(int v, int bits) {
+    int s = 32 - bits;
+    unsigned u = static_cast<unsigned>(v) << s >> s;
+    int n = static_cast<int>(static_cast<unsigned>(v) << s) >> s;
+    return QString(HEXFORMAT).arg(QString::number(u, 16).toUpper(), bits / 4, QChar('0')).arg(n);
+}
+
+MemoryModel::MemoryModel(const StackCPU *cpu, QObject *parent) : QAbstractListModel(parent), cpu(cpu), pc(-1), len(2), bits(0) {
+}
+
+int MemoryModel::rowCount(const QModelIndex &parent) const {
+    return parent.isValid() ? 0 : shadow.size();
+}
+
+QVariant MemoryModel::data(const QModelIndex &index, int role) const {
+    int i = index.row();
+    if (!index.isValid() || i >= shadow.size()) return QVariant();
+
+    if (role == Qt::DisplayRole) {
+        int m = shadow[i];
+        QString t;
+        // data words of a tagged image show as data, whatever they hold
+        if (code[i]) t = QString::fromStdString(opGetOps(m));
+        if (opGetCode(m) == 0xffff || t == "") t = wordText(m, bits);
+        return QString(cpu->hasBreakpoint(i) ? BRKFORMAT : MEMFORMAT).arg(QString::number(i, 16).toUpper(), len, QChar('0')).arg(t);
+    }
+    if (role == Qt::BackgroundRole && i == pc) {
+        return QGuiApplication::palette().brush(QPalette::Active, QPalette::Highlight);
+    }
+    if (role == Qt::ForegroundRole && i == pc) {
+        return QGuiApplication::palette().brush(QPalette::Active, QPalette::HighlightedText);
+    }
+    return QVariant();
+}
+
+// Re-read memory and its opcode tags from the CPU; data() reads only
+// these copies, since the CPU may be running on the worker thread. A
+// new memory size or word width resets the model. Otherwise, as long
+// as memory still starts from the same image, a word or its tag can
+// only have changed on a page that is dirty now or was dirty at the
+// last refresh, so only those pages are compared; each run of changed
+// words becomes one dataChanged().
+void MemoryModel::refresh() {
+    int n = cpu->getMemSize();
+    if (n != shadow.size() || cpu->getWordBits() != bits) {
+        beginResetModel();
+        bits = cpu->getWordBits();
+        shadow.resize(n);
+        code.resize(n);
+        for (int i = 0; i < n; ++i) {
+            shadow[i] = cpu->memory(i);
+            code[i] = cpu->instruction(i);
+        }
+        len = QString::number(n - 1, 16).length();
+        img = cpu->loadedImage();
+        pages = cpu->dirtyPages();
+        endResetModel();
+        return;
+    }
+    const std::vector<int> &dirty = cpu->dirtyPages();
+    std::vector<std::pair<int, int>> ranges;
+    if (cpu->loadedImage() != img) {
+        img = cpu->loadedImage();
+        ranges.push_back(std::make_pair(0, n));
+    } else {
+        pages.insert(pages.end(), dirty.begin(), dirty.end());
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+        for (auto&& p : pages) {
+            int lo = p << PAGESHIFT;
+            int hi = std::min(n, lo + PAGESIZE);
+            if (!ranges.empty() && ranges.back().second == lo) ranges.back().second = hi;
+            else if (lo < hi) ranges.push_back(std::make_pair(lo, hi));
+        }
+    }
+    pages = dirty;
+    for (auto&& r : ranges) {
+        int i = r.first;
+        while (i < r.second) {
+            if (shadow[i] == cpu->memory(i) && code[i] == cpu->instruction(i)) {
+                ++i;
+                continue;
+            }
+            int j = i;
+            while (j < r.second && (shadow[j] != cpu->memory(j) || code[j] != cpu->instruction(j))) {
+                shadow[j] = cpu->memory(j);
+                code[j] = cpu->instruction(j);
+                ++j;
+            }
+            emit dataChanged(index(i), index(j - 1));
+            i = j;
+        }
+    }
+}
+
+void MemoryModel::setPc(int val) {
+    if (val == pc) return;
+    int old = pc;
+    pc = val;
+    touch(old);
+    touch(pc);
+}
+
+// Report a row whose text changed without a memory write, e.g. a
+// breakpoint toggled on it.
+void MemoryModel::touch(int addr) {
+    if (addr >= 0 && addr < shadow.size()) emit dataChanged(index(addr), index(addr));
+}
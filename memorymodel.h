@@ -0,0 +1,63 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#ifndef MEMORYMODEL_H
+#define MEMORYMODEL_H
+
+#include <QAbstractListModel>
+#include <QVector>
+#include <memory>
+#include <vector>
+
+class Image;
+class StackCPU;
+
+QString wordText(int v, int bits);
+
+// List model over the CPU memory for the memory view. Rows are formatted
+// only when the view asks for them, and refresh() compares the pages
+// the CPU has written against a shadow copy so only rows whose word
+// changed are reported.
+class MemoryModel : public QAbstractListModel {
+    Q_OBJECT
+
+public:
+    explicit MemoryModel(const StackCPU *cpu, QObject *parent = 0);
+    int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    void refresh();
+    void setPc(int pc);
+    void touch(int addr);
+
+private:
+    const StackCPU *cpu;
+    QVector<int> shadow;
+    // whether each word may run as an instruction, see
+    // StackCPU::instruction()
+    QVector<bool> code;
+    std::shared_ptr<const Image> img;
+    std::vector<int> pages;
+    int pc;
+    int len;
+    int bits;
+};
+
+#endif // MEMORYMODEL_H
@@ -0,0 +1,208 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#include "profiler.h"
+#include "stackcpu.h"
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+
+Profile::Profile() {
+    clear();
+}
+
+// Start over, keeping counts in a table for addresses up to size, the
+// program's extent, and in a map past it.
+void Profile::clear(int size) {
+    addrs.assign(size, 0);
+    farAddrs.clear();
+    fill(ops, ops + 0x100, 0);
+    rts.clear();
+    active.clear();
+    rtIndex.clear();
+    paths.clear();
+    pathIndex.clear();
+    frames.clear();
+    n = 0;
+    mark = 0;
+    dmax = 0;
+    rmax = 0;
+    // the top level: not a subroutine, never left
+    Path root = { -1, 0, 0 };
+    paths.push_back(root);
+    Frame top = { 0, -1, 0, 0, 0 };
+    frames.push_back(top);
+}
+
+void Profile::enter(int addr, int rsp) {
+    paths[frames.back().path].self += n - mark;
+    mark = n;
+    // look up before inserting, which would build a node every call
+    auto r = rtIndex.find(addr);
+    if (r == rtIndex.end()) {
+        r = rtIndex.insert(make_pair(addr, (int) rts.size())).first;
+        Routine rt = { addr, 0, 0, 0 };
+        rts.push_back(rt);
+        active.push_back(0);
+    }
+    int i = r->second;
+    ++rts[i].calls;
+    ++active[i];
+
+    int parent = frames.back().path;
+    long long key = (long long) parent << 32 | static_cast<unsigned>(addr);
+    auto p = pathIndex.find(key);
+    if (p == pathIndex.end()) {
+        p = pathIndex.insert(make_pair(key, (int) paths.size())).first;
+        Path path = { parent, addr, 0 };
+        paths.push_back(path);
+    }
+    Frame f = { p->second, i, rsp, n, 0 };
+    frames.push_back(f);
+}
+
+void Profile::leave() {
+    paths[frames.back().path].self += n - mark;
+    mark = n;
+    Frame f = frames.back();
+    frames.pop_back();
+    long long in = n - f.start;
+    rts[f.routine].exclusive += in - f.child;
+    if (--active[f.routine] == 0) rts[f.routine].inclusive += in;
+    frames.back().child += in;
+}
+
+long long Profile::total() const {
+    return n;
+}
+
+long long Profile::count(int addr) const {
+    if (addr >= 0 && addr < (int) addrs.size()) return addrs[addr];
+    auto it = farAddrs.find(addr);
+    return it != farAddrs.end() ? it->second : 0;
+}
+
+long long Profile::opCount(int opc) const {
+    return ops[opc & 0xff];
+}
+
+// Subroutines called so far, most exclusive instructions first. Those
+// still active are charged up to the current instruction.
+vector<Profile::Routine> Profile::routines() const {
+    vector<Routine> v = rts;
+    vector<int> seen(rts.size(), 0);
+    long long child = 0;
+    for (size_t k = frames.size() - 1; k > 0; --k) {
+        const Frame &f = frames[k];
+        long long in = n - f.start;
+        v[f.routine].exclusive += in - f.child - child;
+        // the outermost activation of a recursive routine is charged
+        if (++seen[f.routine] == active[f.routine]) v[f.routine].inclusive += in;
+        child = in;
+    }
+    sort(v.begin(), v.end(), [](const Routine &a, const Routine &b) {
+        return a.exclusive != b.exclusive ? a.exclusive > b.exclusive : a.addr < b.addr;
+    });
+    return v;
+}
+
+int Profile::maxData() const {
+    return dmax;
+}
+
+int Profile::maxReturn() const {
+    return rmax;
+}
+
+// The label at addr, or the address itself.
+string Profile::name(const vector<Symbol> &syms, int addr) const {
+    auto it = lower_bound(syms.begin(), syms.end(), addr, [](const Symbol &s, int a) {
+        return s.addr < a;
+    });
+    if (it != syms.end() && it->addr == addr) return it->name;
+    char buff[16];
+    snprintf(buff, sizeof(buff), "%d", addr);
+    return buff;
+}
+
+// Plain text summary: totals, subroutines, opcodes, then every address
+// executed, each table sorted by count.
+string Profile::report(const vector<Symbol> &syms) const {
+    ostringstream o;
+    char buff[128];
+    o << "instructions " << n << "\n";
+    o << "max depth " << dmax << " data, " << rmax << " return\n";
+
+    o << "\n";
+    snprintf(buff, sizeof(buff), "%-20s %12s %14s %14s\n", "routine", "calls", "inclusive", "exclusive");
+    o << buff;
+    for (auto&& r : routines()) {
+        snprintf(buff, sizeof(buff), "%-20s %12lld %14lld %14lld\n",
+                 name(syms, r.addr).c_str(), r.calls, r.inclusive, r.exclusive);
+        o << buff;
+    }
+
+    vector<pair<long long, int> > v;
+    for (int i = 0; i < 0x100; ++i) {
+        if (ops[i]) v.push_back(make_pair(-ops[i], 0xff00 | i));
+    }
+    sort(v.begin(), v.end());
+    o << "\n";
+    snprintf(buff, sizeof(buff), "%-20s %12s\n", "opcode", "count");
+    o << buff;
+    for (auto&& x : v) {
+        snprintf(buff, sizeof(buff), "%-20s %12lld\n", opGetOps(x.second).c_str(), -x.first);
+        o << buff;
+    }
+
+    v.clear();
+    for (size_t i = 0; i < addrs.size(); ++i) {
+        if (addrs[i]) v.push_back(make_pair(-addrs[i], (int) i));
+    }
+    for (auto&& a : farAddrs) v.push_back(make_pair(-a.second, a.first));
+    sort(v.begin(), v.end());
+    o << "\n";
+    snprintf(buff, sizeof(buff), "%-20s %12s\n", "addr", "count");
+    o << buff;
+    for (auto&& x : v) {
+        snprintf(buff, sizeof(buff), "%-20d %12lld\n", x.second, -x.first);
+        o << buff;
+    }
+    return o.str();
+}
+
+// One line per call chain that ran instructions of its own, in the
+// folded format flame graph tools read: "main;outer;inner count".
+string Profile::folded(const vector<Symbol> &syms) const {
+    ostringstream o;
+    vector<string> names(paths.size());
+    names[0] = "main";
+    for (size_t i = 1; i < paths.size(); ++i) {
+        // parents always precede their children
+        names[i] = names[paths[i].parent] + ";" + name(syms, paths[i].addr);
+    }
+    for (size_t i = 0; i < paths.size(); ++i) {
+        // the innermost path is charged up to the current instruction
+        long long self = paths[i].self + ((int) i == frames.back().path ? n - mark : 0);
+        if (self) o << names[i] << " " << self << "\n";
+    }
+    return o.str();
+}
@@ -0,0 +1,120 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "image.h"
+
+using namespace std;
+
+// Execution counts gathered by StackCPU while profiling is on. Every
+// instruction is charged to its address, its opcode and the subroutine
+// active at the time. A subroutine is entered by a CALL to it and left
+// once the return stack drops below the depth that CALL left behind,
+// whether by EXIT or by R>.
+class Profile {
+public:
+    // inclusive counts instructions run by the subroutine and everything
+    // it calls, recursive calls counted once; exclusive only its own
+    struct Routine {
+        int addr;
+        long long calls;
+        long long inclusive, exclusive;
+    };
+
+    Profile();
+    void clear(int size = 0);
+    long long total() const;
+    long long count(int addr) const;
+    long long opCount(int opc) const;
+    vector<Routine> routines() const;
+    int maxData() const;
+    int maxReturn() const;
+    string report(const vector<Symbol> &syms) const;
+    string folded(const vector<Symbol> &syms) const;
+
+    // bracket every executed instruction; call is the target of a CALL
+    // just taken, -1 otherwise. Addresses past the size given to clear()
+    // are counted in a map, so size need only cover the program.
+    void before(int addr, int opc) {
+        charge(addr, opc, 1);
+        ++n;
+    }
+    void after(int call, int dsp, int rsp) {
+        while (frames.size() > 1 && rsp < frames.back().rsp) leave();
+        if (call >= 0) enter(call, rsp);
+        depth(dsp, rsp);
+    }
+
+    // the threaded engine counts instructions itself: elapse() moves
+    // the total on by the k run since, before each after() it calls on
+    // a CALL, EXIT or R>, and charge() hands over the per-address
+    // counts once the run stops
+    void elapse(long long k) { n += k; }
+    void charge(int addr, int opc, long long k) {
+        if (static_cast<unsigned>(addr) < addrs.size()) addrs[addr] += k;
+        else farAddrs[addr] += k;
+        ops[opc & 0xff] += k;
+    }
+    void depth(int dsp, int rsp) {
+        if (dsp > dmax) dmax = dsp;
+        if (rsp > rmax) rmax = rsp;
+    }
+
+private:
+    // a distinct chain of active subroutines, for the folded stacks
+    struct Path {
+        int parent;
+        int addr;
+        long long self;
+    };
+    struct Frame {
+        int path;
+        int routine;
+        int rsp;
+        long long start, child;
+    };
+
+    vector<long long> addrs;
+    unordered_map<int, long long> farAddrs;
+    long long ops[0x100];
+    vector<Routine> rts;
+    vector<int> active;
+    unordered_map<int, int> rtIndex;
+    vector<Path> paths;
+    unordered_map<long long, int> pathIndex;
+    vector<Frame> frames;
+    long long n;
+    // the total when the innermost path was last charged its own
+    // instructions, on entering or leaving a subroutine
+    long long mark;
+    int dmax, rmax;
+
+    void enter(int addr, int rsp);
+    void leave();
+    string name(const vector<Symbol> &syms, int addr) const;
+};
+
+#endif // PROFILER_H
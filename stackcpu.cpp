@@ -19,8 +19,17 @@
 ****************************************************************************/
 
 #include "stackcpu.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <deque>
+#include <istream>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
-#define MAXSTACK 0xff
 #define OPL 0x12
 
 #define E001 "Label redecleared: %s"
@@ -31,62 +40,126 @@
 #define E006 "PC out of bounds"
 #define E007 "\"x%s\" is not an opcode"
 #define E008 "Out of memory"
+#define E009 "Cannot write image: %s"
+#define E010 "Cannot load image: %s"
+#define E011 "Cannot write trace: %s"
+#define E012 "Cannot read source: %s"
+#define E013 "Cannot store into code"
+
+#define SLICE 0x10000
+// bytes read at a time by compile(istream &) and compile(int)
+#define COMPILECHUNK 0x10000
+// line fragments cached beyond twice the lines compiled
+#define MAXFRAGCACHE 0x1000
+#define MAXDECODE 0x10000
+// longest fused sequence in words, operands included
+#define MAXFUSE 4
+// shortest block worth running unchecked, entering one costs about as
+// much as the checks of a few ops
+#define MINBLOCK 8
+// block entries before the Jit engine compiles a region from it; it
+// counts the entries of every block within a loop, whatever its length
+#define HOTBLOCK 64
+// most blocks compiled into one region
+#define MAXREGION 16
+// words of undo journal kept, a few million steps; older steps drop out
+#define MAXJOURNAL 0x1000000
+
+// the machine's + and - wrap around; signed overflow would be undefined
+static inline int wrapAdd(int a, int b) {
+    return static_cast<int>(static_cast<unsigned>(a) + static_cast<unsigned>(b));
+}
+
+static inline int wrapSub(int a, int b) {
+    return static_cast<int>(static_cast<unsigned>(a) - static_cast<unsigned>(b));
+}
+
+// Data narrower than a full word is kept sign-extended from its width,
+// s being 32 less the width, so that it wraps around there.
+static inline int narrow(int v, int s) {
+    return static_cast<int>(static_cast<unsigned>(v) << s) >> s;
+}
+
+// Memory address held in a value: narrower words address memory
+// unsigned, a full word as a signed int.
+static inline int address(int v, int s) {
+    return static_cast<int>(static_cast<unsigned>(v) & (~0u >> s));
+}
+
+// whether a number written in the source fits the word width, spelt
+// signed or unsigned
+static bool fits(long long v, int bits) {
+    return v >= -(1LL << (bits - 1)) && v < (1LL << bits);
+}
 
 const Opcode opcodes[OPL] = {
-    {"LIT",     0xff00, 2},
-    {"@",       0xff01, 1},
-    {"!",       0xff02, 1},
-    {"DROP",    0xff03, 1},
-    {"DUP",     0xff04, 1},
-    {"OVER",    0xff05, 1},
-    {"SWAP",    0xff06, 1},
-    {"+",       0xff07, 1},
-    {"-",       0xff08, 1},
-    {"AND",     0xff09, 1},
-    {"OR",      0xff0a, 1},
-    {"XOR",     0xff0b, 1},
-    {"IF",      0xff0c, 2},
-    {"CALL",    0xff0d, 2},
-    {"EXIT",    0xff0e, 0},
-    {"HALT",    0xff0f, 0},
-    {">R",      0xff10, 1},
-    {"R>",      0xff11, 1},
+    {"LIT",     0xff00, 2, 0, 1, 0, 0},
+    {"@",       0xff01, 1, 1, 1, 0, 0},
+    {"!",       0xff02, 1, 2, 0, 0, 0},
+    {"DROP",    0xff03, 1, 1, 0, 0, 0},
+    {"DUP",     0xff04, 1, 1, 2, 0, 0},
+    {"OVER",    0xff05, 1, 2, 3, 0, 0},
+    {"SWAP",    0xff06, 1, 2, 2, 0, 0},
+    {"+",       0xff07, 1, 2, 1, 0, 0},
+    {"-",       0xff08, 1, 2, 1, 0, 0},
+    {"AND",     0xff09, 1, 2, 1, 0, 0},
+    {"OR",      0xff0a, 1, 2, 1, 0, 0},
+    {"XOR",     0xff0b, 1, 2, 1, 0, 0},
+    {"IF",      0xff0c, 2, 1, 0, 0, 0},
+    {"CALL",    0xff0d, 2, 0, 0, 0, 1},
+    {"EXIT",    0xff0e, 0, 0, 0, 1, 0},
+    {"HALT",    0xff0f, 0, 0, 0, 0, 0},
+    {">R",      0xff10, 1, 1, 0, 0, 1},
+    {"R>",      0xff11, 1, 0, 1, 1, 0},
 };
 
-int opGetPci(string ops) {
-    for (auto&& op : opcodes) {
-        if (op.ops == ops) {
-            return op.pci;
-        }
+// perfect hash over the mnemonics in opcodes[]; opHashTable maps each
+// slot to its opcodes[] index or -1, and must be kept in sync by hand
+#define OPHASHSIZE 32
+
+static inline unsigned opHash(const char *s, size_t n) {
+    return (n + s[0] * 11 + s[n - 1] * 30) & (OPHASHSIZE - 1);
+}
+
+static const signed char opHashTable[OPHASHSIZE] = {
+    -1,  1, -1, 10,  7,  5,  9, 11,
+    16, -1,  2, -1, 17, 13, -1,  4,
+     3, -1, -1, 14, 15,  6,  8, -1,
+    -1, 12, -1, -1, -1, -1, -1,  0,
+};
+
+const Opcode *opFind(const char *s, size_t n) {
+    if (n == 0) return NULL;
+    int i = opHashTable[opHash(s, n)];
+    if (i < 0 || opcodes[i].ops.size() != n || memcmp(opcodes[i].ops.data(), s, n) != 0) {
+        return NULL;
     }
-    return 0;
+    return &opcodes[i];
+}
+
+const Opcode *opFind(int opc) {
+    unsigned i = opc - 0xff00;
+    return i < OPL ? &opcodes[i] : NULL;
+}
+
+int opGetPci(string ops) {
+    const Opcode *op = opFind(ops.data(), ops.size());
+    return op ? op->pci : 0;
 }
 
 int opGetPci(int opc) {
-    for (auto&& op : opcodes) {
-        if (op.opc == opc) {
-            return op.pci;
-        }
-    }
-    return 0;
+    const Opcode *op = opFind(opc);
+    return op ? op->pci : 0;
 }
 
 int opGetOpc(string ops) {
-    for (auto&& op : opcodes) {
-        if (op.ops == ops) {
-            return op.opc;
-        }
-    }
-    return 0xffff;
+    const Opcode *op = opFind(ops.data(), ops.size());
+    return op ? op->opc : 0xffff;
 }
 
 string opGetOps(int opc) {
-    for (auto&& op : opcodes) {
-        if (op.opc == opc) {
-            return op.ops;
-        }
-    }
-    return "";
+    const Opcode *op = opFind(opc);
+    return op ? op->ops : "";
 }
 
 int opGetCode(int opc) {
@@ -94,16 +167,23 @@ int opGetCode(int opc) {
     return 0xffff;
 }
 
-bool tryNumToInt(string num, int *val) {
-    char* ok = NULL;
-    if (num.substr(0, 1) == "B")
-        *val = strtol(num.substr(1, num.length() - 1).c_str(), &ok, 2);
-    else if (num.substr(0, 2) == "0X")
-        *val = strtol(num.substr(2, num.length() - 2).c_str(), &ok, 16);
-    else if (num.substr(0, 1) == "X")
-        *val = strtol(num.substr(1, num.length() - 1).c_str(), &ok, 16);
+bool opStackFits(const Opcode &op, int dsp, int rsp) {
+    return dsp >= op.dsi && dsp - op.dsi + op.dso <= MAXSTACK
+        && rsp >= op.rsi && rsp - op.rsi + op.rso <= MAXSTACK;
+}
+
+// Parses num in full, so the caller can check it against the word
+// width with fits() before narrowing it to a word.
+bool tryNumToInt(const char *num, long long *val) {
+    char *ok = NULL;
+    if (num[0] == 'B')
+        *val = strtoll(num + 1, &ok, 2);
+    else if (num[0] == '0' && num[1] == 'X')
+        *val = strtoll(num + 2, &ok, 16);
+    else if (num[0] == 'X')
+        *val = strtoll(num + 1, &ok, 16);
     else
-        *val = strtol(num.c_str(), &ok, 10);
+        *val = strtoll(num, &ok, 10);
     return ok[0] != num[0];
 }
 
@@ -115,356 +195,1907 @@ string strToUpper(string s) {
     return r;
 }
 
-string intToStr(int i) {
+string badOpcodeError(int s) {
     char buff[255];
-    sprintf(buff, "%d", i);
+    sprintf(buff, "%x", static_cast<unsigned char>(s));
+    string a = buff;
+    if (a.length() == 1) a = string(1, '0').append(a);
+    sprintf(buff, E007, strToUpper(a).c_str());
     return buff;
 }
 
 StackCPU::StackCPU() {
     lines = new vector<string>();
-    ds = new vector<int>();
-    rs = new vector<int>();
+    fragBits = 0;
+    diagsValid = true;
+    dsp = 0;
+    rsp = 0;
     lastError = "";
     lastErrorAddr = 0;
+    lastErrorLine = 0;
     memSize = 32;
-    mem = new int[memSize];
-    memset(mem, 0, memSize * sizeof(int));
-    ftmem = new int[memSize];
-    memset(ftmem, 0, memSize * sizeof(int));
+    wordBits = 32;
+    shift = 0;
+    ftimage = make_shared<const Image>(vector<int>(), memSize);
+    mem.load(ftimage);
     fpc = -1;
     fhalt = true;
+    stop = StopNone;
+    watchHit = -1;
+    steps = 0;
+    journaling = false;
+    profiling = false;
+    engine = Threaded;
+    codeSize = 0;
+    codeValid = false;
+    staleBlocks = 0;
+    optimize = true;
+    protectCode = false;
+}
+
+// A CPU ready to run img from address 0. Memory is shared with img
+// until the program stores into it.
+StackCPU::StackCPU(shared_ptr<const Image> img) {
+    lines = new vector<string>();
+    fragBits = 0;
+    diagsValid = true;
+    lastError = "";
+    lastErrorAddr = 0;
+    lastErrorLine = 0;
+    ftimage = img;
+    wordBits = 0;
+    stop = StopNone;
+    watchHit = -1;
+    codeSize = 0;
+    codeValid = false;
+    staleBlocks = 0;
+    optimize = true;
+    protectCode = false;
+    journaling = false;
+    profiling = false;
+    engine = Threaded;
+    clearStack();
 }
 
 StackCPU::~StackCPU() {
     delete lines;
-    delete ds;
-    delete rs;
-    delete[] mem;
-    delete[] ftmem;
 }
 
-int StackCPU::getMem(int addr) {
+int StackCPU::getMem(int addr) const {
     if (addr < 0 || addr >= memSize) {
         return 0;
     }
-    return mem[addr];
+    return mem.read(addr);
 }
 
+// Unless code is protected, a word written into a page holding code
+// becomes code too, so new instructions stored over operands or data
+// run; see Memory::retag().
 void StackCPU::setMem(int addr, int val) {
     if (addr >= 0 && addr < memSize) {
-        mem[addr] = val;
+        mem.write(addr, val);
+        if (!protectCode) mem.retag(addr);
+        if (codeValid && isCode(addr)) {
+            // keep the decoded image in sync with self-modifying code
+            invalidate(addr);
+            for (int i = max(0, addr - (MAXFUSE - 1)); i <= addr; ++i) decodeAt(i);
+        }
     }
 }
 
-bool StackCPU::push(vector<int> *stack, int val) {
-    if (stack->size() < MAXSTACK) {
-        stack->push_back(val);
-        return true;
-    }
-    return false;
+// the word at address v as data, as @ loads it
+int StackCPU::load(int v) const {
+    return narrow(getMem(address(v, shift)), shift);
 }
 
-int StackCPU::pop(vector<int> *stack) {
-    if (!stack->empty()) {
-        int top = stack->back();
-        stack->pop_back();
-        return top;
-    }
-    return 0xffff;
+// With protectCode set, opcodes and their operands in a tagged image
+// are read-only to the program.
+bool StackCPU::readOnly(int addr) const {
+    if (!protectCode || !mem.tagged()) return false;
+    if (mem.instruction(addr)) return true;
+    return addr > 0 && mem.instruction(addr - 1) && opGetPci(mem.read(addr - 1)) == 2;
 }
 
-int StackCPU::peek(vector<int> *stack) {
-    if (!stack->empty()) {
-        return stack->back();
-    }
-    return 0xffff;
+// Op index of the instruction at addr, or OPL where the word is not
+// one: outside memory, not an opcode, or data in a tagged image.
+int StackCPU::opAt(int addr) const {
+    if (addr < 0 || addr >= memSize || !mem.instruction(addr)) return OPL;
+    const Opcode *op = opFind(mem.read(addr));
+    return op ? op - opcodes : OPL;
 }
 
-void StackCPU::lineReconstruct() {
-    vector<string> l;
-    string s, t;
-    for (auto&& s : *lines) {
-        t = "";
-        for (auto&& c : s) {
-            if (c == ' ' || c == '\t') {
-                if (t != "") l.push_back(strToUpper(t));
-                t = "";
-                continue;
+void StackCPU::compileError(const char *fmt, const Token &t, int addr) {
+    char buff[255];
+    snprintf(buff, sizeof(buff), fmt, t.s);
+    lastError = buff;
+    lastErrorAddr = addr;
+    lastErrorLine = t.line;
+}
+
+// Assembler state between compileChunk() calls. Code goes straight
+// into the image words. Label names are copied once, since tokens do
+// not outlive their chunk, and only references ahead of their label
+// wait for endCompile(). Words past memSize are counted, not kept, so
+// errors further on are still reported first.
+struct StackCPU::Assembly {
+    struct Ref {
+        int addr;
+        int label;
+        int line, col;
+    };
+
+    Tokenizer tok;
+    vector<int> words;
+    // a bit per opcode word, see Image::tags()
+    vector<unsigned char> tags;
+    // label names, ids by name, and addresses by id, -1 until defined
+    deque<string> names;
+    unordered_map<Token, int, TokenHash, TokenEqual> ids;
+    vector<int> addrs;
+    vector<Ref> refs;
+    // operands the last op still takes
+    int operands;
+    int size;
+    // first unknown word
+    string badWord;
+    Ref bad;
+    bool failed;
+
+    int label(const Token &t);
+};
+
+int StackCPU::Assembly::label(const Token &t) {
+    auto it = ids.find(t);
+    if (it != ids.end()) return it->second;
+    names.push_back(string(t.s, t.len));
+    Token name = { names.back().c_str(), t.len, 0, 0 };
+    ids.insert(make_pair(name, (int) addrs.size()));
+    addrs.push_back(-1);
+    return addrs.size() - 1;
+}
+
+void StackCPU::beginCompile() {
+    assembly.reset(new Assembly());
+    Assembly &a = *assembly;
+    a.operands = 0;
+    a.size = 0;
+    a.bad.addr = -1;
+    a.failed = false;
+}
+
+// Assembles one token. Errors keep the order of the former two pass
+// assembler: malformed operands, range errors and duplicate labels
+// stop at once, while unknown words and undeclared labels are
+// reported at the end, lowest address first.
+bool StackCPU::assemble(const Token &t) {
+    Assembly &a = *assembly;
+    long long l;
+    if (a.operands > 0) {
+        --a.operands;
+        if (t.s[0] == ':') {
+            int id = a.label(t);
+            l = a.addrs[id];
+            if (l < 0) {
+                Assembly::Ref r = { a.size, id, t.line, t.col };
+                a.refs.push_back(r);
+                l = 0;
+            } else if (!fits(l, wordBits)) {
+                // narrower words would wrap the address
+                compileError(E004, t, a.size);
+                return false;
             }
-            if (c == ';') break;
-            t += c;
+        } else if (!tryNumToInt(t.s, &l)) {
+            compileError(E002, t, a.size);
+            return false;
+        } else if (!fits(l, wordBits)) {
+            compileError(E004, t, a.size);
+            return false;
+        }
+    } else if (t.s[0] == ':') {
+        int id = a.label(t);
+        if (a.addrs[id] >= 0) {
+            compileError(E001, t, a.size);
+            return false;
+        }
+        a.addrs[id] = a.size;
+        return true;
+    } else if (const Opcode *op = opFind(t.s, t.len)) {
+        a.operands = max(op->pci - 1, 0);
+        l = op->opc;
+        if (a.size < memSize) {
+            if ((size_t) a.size >> 3 >= a.tags.size()) a.tags.resize((a.size >> 3) + 1);
+            a.tags[a.size >> 3] |= 1 << (a.size & 7);
         }
-        if (t != "") l.push_back(strToUpper(t));
+    } else if (!tryNumToInt(t.s, &l)) {
+        if (a.bad.addr < 0) {
+            a.badWord.assign(t.s, t.len);
+            Assembly::Ref r = { a.size, -1, t.line, t.col };
+            a.bad = r;
+        }
+        l = 0;
+    } else if (!fits(l, wordBits)) {
+        compileError(E004, t, a.size);
+        return false;
     }
-    lines->clear();
-    lines->insert(lines->end(), l.begin(), l.end());
+    if (a.size < memSize) a.words.push_back(static_cast<int>(l));
+    ++a.size;
+    return true;
 }
 
-bool StackCPU::preprocessing() {
-    vector<Opcode> m;
-    string s;
-    int l;
-
-    // find label and convert number to decimal
-    for (size_t i = 0; i < lines->size(); ) {
-        s = lines->at(i);
-        if (s.substr(0, 1) != ":") {
-            int j = opGetPci(s);
-            for (int k = 1; k < j; ++k) {
-                if (i + k >= lines->size()) break;
-                s = lines->at(i + k);
-                if (s.substr(0, 1) != ":") {
-                    if (tryNumToInt(s, &l)) {
-                        if ((abs(l) & 0xff00) != 0) {
-                            char buff[255];
-                            sprintf(buff, E004, s.c_str());
-                            lastError = buff;
-                            lastErrorAddr = i + k;
-                            return false;
-                        }
-                        lines->at(i + k) = intToStr(l);
-                    } else {
-                        char buff[255];
-                        sprintf(buff, E002, s.c_str());
-                        lastError = buff;
-                        lastErrorAddr = i + k;
-                        return false;
-                    }
-                }
-            }
-            if (j != 0) i += j; else ++i;
-            continue;
-        } else {
-            // check dup
-            for (auto&& op : m) {
-                if (op.ops == s) {
-                    char buff[255];
-                    sprintf(buff, E001, s.c_str());
-                    lastError = buff;
-                    lastErrorAddr = i;
-                    return false;
-                }
-            }
-            Opcode t;
-            t.ops = s;
-            t.opc = i;
-            m.push_back(t);
-            lines->erase(lines->begin() + i);
-        }
-    }
-
-    // replace label
-    for (auto&& s : *lines) {
-        if (s.substr(0, 1) == ":") {
-            for (auto&& op : m) {
-                if (op.ops == s) {
-                    s = intToStr(op.opc);
-                    break;
-                }
-            }
+// Assembles the tokens scanned so far, then lets the tokenizer reuse
+// their space.
+bool StackCPU::assembleTokens() {
+    Assembly &a = *assembly;
+    for (auto&& t : a.tok.tokens()) {
+        if (!assemble(t)) {
+            a.failed = true;
+            break;
         }
     }
-    return true;
+    a.tok.drop();
+    return !a.failed;
 }
 
-bool StackCPU::processing() {
-    vector<int> d;
-    string s;
-    int op, l;
+// Feeds the next part of the source; a chunk may end anywhere, even
+// inside a word or a comment. Returns false once the source has an
+// error that stops assembly, which endCompile() reports again.
+bool StackCPU::compileChunk(const char *buf, size_t n) {
+    if (!assembly) beginCompile();
+    if (assembly->failed) return false;
+    assembly->tok.scan(buf, n);
+    return assembleTokens();
+}
 
-    for (size_t i = 0; i < lines->size(); ++i) {
-        s = lines->at(i);
-        op = opGetOpc(s);
-        if (op != 0xffff) {
-            d.push_back(op);
-        } else {
-            if (tryNumToInt(s, &l)) {
-                d.push_back(l);
-            } else {
-                if (s.substr(0, 1) == ":") {
-                    char buff[255];
-                    sprintf(buff, E003, s.c_str());
-                    lastError = buff;
-                } else {
-                    char buff[255];
-                    sprintf(buff, E002, s.c_str());
-                    lastError = buff;
-                }
-                lastErrorAddr = i;
-                return false;
+bool StackCPU::endCompile() {
+    if (!assembly) beginCompile();
+    bool ok = !assembly->failed;
+    if (ok) {
+        assembly->tok.finish();
+        ok = assembleTokens();
+    }
+    unique_ptr<Assembly> as(move(assembly));
+    Assembly &a = *as;
+    if (!ok) return false;
+
+    // patch references ahead of their labels
+    const Assembly::Ref *bad = a.bad.addr >= 0 ? &a.bad : NULL;
+    const char *error = E002;
+    for (auto&& r : a.refs) {
+        int l = a.addrs[r.label];
+        if (l < 0 || !fits(l, wordBits)) {
+            if (!bad || r.addr < bad->addr) {
+                bad = &r;
+                error = l < 0 ? E003 : E004;
             }
+            break;
         }
+        if (r.addr < memSize) a.words[r.addr] = l;
+    }
+    if (bad) {
+        const string &w = bad->label < 0 ? a.badWord : a.names[bad->label];
+        Token t = { w.c_str(), static_cast<int>(w.size()), bad->line, bad->col };
+        compileError(error, t, bad->addr);
+        return false;
     }
 
-    size_t m = (size_t) memSize;
-    delete[] ftmem;
-    ftmem = new int[m];
-    memset(ftmem, 0, m * sizeof(int));
-    for (size_t i = 0; i < d.size(); ++i) {
-        if (i < m) {
-            ftmem[i] = d[i];
-        } else {
-            lastError = E008;
-            lastErrorAddr = i;
-            return false;
-        }
+    if (a.size > memSize) {
+        lastError = E008;
+        lastErrorAddr = memSize;
+        lastErrorLine = 0;
+        return false;
+    }
+    vector<Symbol> syms;
+    for (size_t i = 0; i < a.names.size(); ++i) {
+        Symbol s = { a.names[i].substr(1), a.addrs[i] };
+        syms.push_back(s);
     }
+    sort(syms.begin(), syms.end(), [](const Symbol &a, const Symbol &b) {
+        return a.addr != b.addr ? a.addr < b.addr : a.name < b.name;
+    });
+    // an image of data alone is tagged all the same
+    a.tags.resize(a.words.size() / 8 + 1);
+    ftimage = make_shared<const Image>(move(a.words), memSize, move(syms), wordBits, move(a.tags));
+    diagsValid = false;
     return true;
 }
 
 bool StackCPU::step() {
-    bool ret = false;
-    bool nop = false;
-    int addr, tmp1, tmp2;
-    int s = mem[fpc];
+    // memory is only read within bounds; a PC left out of them by a
+    // failed jump stops here again
+    if (fpc < 0 || fpc >= memSize) {
+        lastError = E006;
+        lastErrorAddr = fpc;
+        stop = StopError;
+        return false;
+    }
+    const int sh = shift;
+    int addr = 0, tmp;
+    int at = fpc;
+    int s = mem.read(fpc);
+    int c = static_cast<unsigned>(s - 0xff00) < OPL && mem.instruction(fpc) ? s - 0xff00 : OPL;
+
+    stop = StopNone;
+    if (c >= OPL) {
+        lastError = badOpcodeError(s);
+        lastErrorAddr = fpc;
+        stop = StopError;
+        return false;
+    }
+    if (!opStackFits(opcodes[c], dsp, rsp)) {
+        lastError = E005;
+        lastErrorAddr = fpc;
+        stop = StopError;
+        return false;
+    }
+    if (c == 0x2 && readOnly(address(ds[dsp - 1], sh))) {
+        lastError = E013;
+        lastErrorAddr = fpc;
+        stop = StopError;
+        return false;
+    }
+    if (journaling) record(opcodes[c], fpc, dsp, rsp);
+    if (profiling) prof.before(fpc, s);
+    ++steps;
 
     switch (s) {
     case 0xff00:
-        ret = push(ds, getMem(fpc + 1));
+        ds[dsp++] = narrow(getMem(fpc + 1), sh);
         break;
     case 0xff01:
-        addr = pop(ds);
-        ret = (addr != 0xffff) && push(ds, getMem(addr));
+        ds[dsp - 1] = load(ds[dsp - 1]);
         break;
     case 0xff02:
-        addr = pop(ds);
-        ret = addr != 0xffff;
-        setMem(addr, pop(ds));
+        addr = address(ds[--dsp], sh);
+        setMem(addr, ds[--dsp]);
+        if (!watchpoints.empty() && watched(addr)) {
+            watchHit = addr;
+            stop = StopWatchpoint;
+        }
         break;
     case 0xff03:
-        ret = pop(ds) != 0xffff;
+        --dsp;
         break;
     case 0xff04:
-        tmp1 = peek(ds);
-        ret = (tmp1 != 0xffff) && push(ds, tmp1);
+        ds[dsp] = ds[dsp - 1];
+        ++dsp;
         break;
     case 0xff05:
-        tmp1 = pop(ds);
-        tmp2 = peek(ds);
-        push(ds, tmp1);
-        ret = (tmp2 != 0xffff) && push(ds, tmp2);
+        ds[dsp] = ds[dsp - 2];
+        ++dsp;
         break;
     case 0xff06:
-        tmp1 = pop(ds);
-        tmp2 = pop(ds);
-        push(ds, tmp1);
-        ret = (tmp2 != 0xffff) && push(ds, tmp2);
+        tmp = ds[dsp - 1];
+        ds[dsp - 1] = ds[dsp - 2];
+        ds[dsp - 2] = tmp;
         break;
     case 0xff07:
-        tmp2 = pop(ds);
-        tmp1 = pop(ds);
-        ret = (tmp1 != 0xffff) && push(ds, tmp1 + tmp2);
+        --dsp;
+        ds[dsp - 1] = narrow(wrapAdd(ds[dsp - 1], ds[dsp]), sh);
         break;
     case 0xff08:
-        tmp2 = pop(ds);
-        tmp1 = pop(ds);
-        ret = (tmp1 != 0xffff) && push(ds, tmp1 - tmp2);
+        --dsp;
+        ds[dsp - 1] = narrow(wrapSub(ds[dsp - 1], ds[dsp]), sh);
         break;
     case 0xff09:
-        tmp2 = pop(ds);
-        tmp1 = pop(ds);
-        ret = (tmp1 != 0xffff) && push(ds, tmp1 & tmp2);
+        --dsp;
+        ds[dsp - 1] &= ds[dsp];
         break;
     case 0xff0a:
-        tmp2 = pop(ds);
-        tmp1 = pop(ds);
-        ret = (tmp1 != 0xffff) && push(ds, tmp1 | tmp2);
+        --dsp;
+        ds[dsp - 1] |= ds[dsp];
         break;
     case 0xff0b:
-        tmp2 = pop(ds);
-        tmp1 = pop(ds);
-        ret = (tmp1 != 0xffff) && push(ds, tmp1 ^ tmp2);
+        --dsp;
+        ds[dsp - 1] ^= ds[dsp];
         break;
     case 0xff0c:
-        tmp1 = pop(ds);
-        ret = tmp1 != 0xffff;
-        if (tmp1 == 0) {
+        if (ds[--dsp] == 0) {
             fpc = getMem(fpc + 1);
             s = 0xf;
         }
         break;
     case 0xff0d:
-        ret = push(rs, fpc + 2);
+        rs[rsp++] = fpc + 2;
         fpc = getMem(fpc + 1);
         s = 0xf;
         break;
     case 0xff0e:
-        fpc = pop(rs);
-        ret = fpc != 0xffff;
+        fpc = rs[--rsp];
         break;
     case 0xff0f:
         fhalt = true;
-        ret = true;
+        stop = StopHalt;
         break;
     case 0xff10:
-        tmp1 = pop(ds);
-        ret = (tmp1 != 0xffff) && push(rs, tmp1);
+        rs[rsp++] = ds[--dsp];
         break;
     case 0xff11:
-        tmp1 = pop(rs);
-        ret = (tmp1 != 0xffff) && push(ds, tmp1);
+        ds[dsp++] = narrow(rs[--rsp], sh);
         break;
-    default:
-       nop = true;
     }
-    if (ret) {
-        fpc += opGetPci(s);
-    } else {
-        if (!nop) {
-            lastError = E005;
-        } else {
-            char buff[255];
-            sprintf(buff, "%x", static_cast<unsigned char>(s));
-            string a = buff;
-            if (a.length() == 1) a = string(1, '0').append(a);
-            sprintf(buff, E007, strToUpper(a).c_str());
-            lastError = buff;
-        }
-        lastErrorAddr = fpc;
+    fpc += opGetPci(s);
+    if (profiling) prof.after(c == 0xd ? fpc : -1, dsp, rsp);
+    if (tracer) {
+        if (c == 0x2) tracer->put(at, c, dsp ? ds[dsp - 1] : 0, addr, ds[dsp]);
+        else tracer->put(at, c, dsp ? ds[dsp - 1] : 0);
     }
-    if (fpc >= memSize) {
-        ret = false;
+    if (fpc < 0 || fpc >= memSize) {
         lastError = E006;
         lastErrorAddr = fpc;
+        stop = StopError;
+        return false;
+    }
+    return true;
+}
+
+// decoded op indices, equal to the low byte of the matching opcode
+enum {
+    OP_LIT, OP_FETCH, OP_STORE, OP_DROP, OP_DUP, OP_OVER, OP_SWAP,
+    OP_ADD, OP_SUB, OP_AND, OP_OR, OP_XOR, OP_IF, OP_CALL, OP_EXIT,
+    OP_HALT, OP_TOR, OP_RFROM, OP_BAD, OP_OOB, OP_TRAP, OP_STOREW,
+    // superinstructions, see fuse()
+    OP_LITADD, OP_LITSUB, OP_LITFETCH, OP_LITIF, OP_DUPIF, OP_OVEROVER,
+    OP_SWAPDROP, OP_RFETCH,
+    // ops that narrow what they push to words under 32 bits, see baseOp()
+    OP_FETCHN, OP_ADDN, OP_SUBN, OP_RFROMN,
+    // leader of a verified block, the block holds the decoded op
+    OP_BLOCK,
+    // leader of a block compiled to native code
+    OP_JIT,
+    // word in a page not decoded yet
+    OP_DECODE
+};
+
+// Whether op c carries on to the next word; blocks ending in a jump,
+// store or halt leave the unchecked path there.
+static bool runsOn(int c) {
+    switch (c) {
+    case OP_STORE: case OP_IF: case OP_CALL: case OP_EXIT: case OP_HALT:
+        return false;
+    }
+    return true;
+}
+
+// Append block n, which b runs on into, to b's stack figures.
+static void extend(Block *b, const Block &n) {
+    b->dneed = max(b->dneed, n.dneed - b->ddelta);
+    b->dgrow = max(b->dgrow, b->ddelta + n.dgrow);
+    b->ddelta += n.ddelta;
+    b->rneed = max(b->rneed, n.rneed - b->rdelta);
+    b->rgrow = max(b->rgrow, b->rdelta + n.rgrow);
+    b->rdelta += n.rdelta;
+    b->end = n.end;
+    b->last = n.last;
+    b->count += n.count;
+}
+
+// A fused op never spans a block leader, so a block run unchecked
+// stays within the words it was verified for.
+bool StackCPU::fusable(int addr) const {
+    return addr < codeSize && dec->codePages[addr >> PAGESHIFT]
+        && (breakpoints.empty() || !breakpoints.count(addr)) && dec->blockAt[addr] < 0;
+}
+
+// Decoded op for the instruction at addr before any fusing. While
+// watchpoints exist stores take OP_STOREW, and below 32 bits the ops
+// that push loaded or computed values take the forms that narrow them,
+// so full words run without either check.
+int StackCPU::baseOp(int addr) const {
+    int c = opAt(addr);
+    if (c >= OPL) return OP_BAD;
+    if (c == OP_STORE && !watchpoints.empty()) return OP_STOREW;
+    if (shift) {
+        switch (c) {
+        case OP_FETCH: return OP_FETCHN;
+        case OP_ADD: return OP_ADDN;
+        case OP_SUB: return OP_SUBN;
+        case OP_RFROM: return OP_RFROMN;
+        }
+    }
+    return c;
+}
+
+// Superinstruction for the sequence starting at addr, whose first op
+// is c, or c itself. Every word of the sequence keeps its own decoded
+// entry, so jumps into the middle still work, and a fused op that
+// would fail hands over to its first op, which then reports the error
+// at the right address.
+int StackCPU::fuse(int addr, int c) const {
+    int w1 = opAt(addr + 1);
+    int w2 = opAt(addr + 2);
+    switch (c) {
+    case OP_LIT:
+        if (!fusable(addr + 2)) break;
+        if (w2 == OP_IF && addr + 3 < codeSize) return OP_LITIF;
+        // the narrowing forms are left unfused
+        if (shift) break;
+        if (w2 == OP_ADD) return OP_LITADD;
+        if (w2 == OP_SUB) return OP_LITSUB;
+        if (w2 == OP_FETCH) return OP_LITFETCH;
+        break;
+    case OP_DUP:
+        if (w1 == OP_IF && fusable(addr + 1) && addr + 2 < codeSize) return OP_DUPIF;
+        break;
+    case OP_OVER:
+        if (w1 == OP_OVER && fusable(addr + 1)) return OP_OVEROVER;
+        break;
+    case OP_SWAP:
+        if (w1 == OP_DROP && fusable(addr + 1)) return OP_SWAPDROP;
+        break;
+    case OP_RFROM:
+        if (w1 == OP_DUP && w2 == OP_TOR && fusable(addr + 1) && fusable(addr + 2)) return OP_RFETCH;
+        break;
+    }
+    return c;
+}
+
+// Breakpoints are patched into the decoded image as OP_TRAP and, while
+// watchpoints exist, stores decode to OP_STOREW, so runs without either
+// take no extra checks. A shared decoding is only copied when the word
+// decodes differently.
+void StackCPU::decodeAt(int addr) {
+    if (addr >= codeSize) return;
+    Insn in = { OP_DECODE, dec->code[addr].arg };
+    int b = -1, op = 0;
+    if (dec->codePages[addr >> PAGESHIFT]) {
+        int c = baseOp(addr);
+        // a literal decodes as the value it pushes
+        in.arg = c == OP_LIT ? narrow(getMem(addr + 1), shift) : getMem(addr + 1);
+        if (!breakpoints.empty() && breakpoints.count(addr)) c = OP_TRAP;
+        // profiles, traces and the journal take every instruction of a
+        // sequence on its own
+        else if (optimize && !profiling && !tracer && !journaling) c = fuse(addr, c);
+        b = dec->blockAt[addr];
+        if (b >= 0 && dec->blocks[b].safe && c != OP_TRAP) {
+            op = c;
+            c = natives[b].code ? OP_JIT : OP_BLOCK;
+        } else {
+            b = -1;
+        }
+        in.op = c;
+    }
+    const Insn &was = dec->code[addr];
+    if (was.op == in.op && was.arg == in.arg && (b < 0 || dec->blocks[b].op == op)) return;
+    Decoding &d = own();
+    d.code[addr] = in;
+    if (b >= 0) d.blocks[b].op = op;
+}
+
+// Mark page p as holding code and decode it, along with the words
+// before it that may fuse into it.
+void StackCPU::decodePage(int p) {
+    if (!dec->codePages[p]) own().codePages[p] = true;
+    int b = p << PAGESHIFT;
+    int e = b + PAGESIZE < codeSize ? b + PAGESIZE : codeSize;
+    for (int i = max(0, b - (MAXFUSE - 1)); i < e; ++i) decodeAt(i);
+}
+
+// Whether decoded code depends on the word at addr: it lies in a code
+// page, or within reach of an operand or fused op at the end of one.
+bool StackCPU::isCode(int addr) const {
+    unsigned p = addr >> PAGESHIFT;
+    const vector<bool> &pages = dec->codePages;
+    if (p >= pages.size()) return false;
+    return pages[p] || ((addr & PAGEMASK) < MAXFUSE - 1 && p > 0 && pages[p - 1]);
+}
+
+void StackCPU::decodePages(const vector<int> &pages) {
+    for (auto&& p : pages) {
+        if (!isCode(p << PAGESHIFT)) continue;
+        int b = p << PAGESHIFT;
+        int e = b + PAGESIZE < codeSize ? b + PAGESIZE : codeSize;
+        for (int i = b; i < e; ++i) invalidate(i);
+        for (int i = max(0, b - (MAXFUSE - 1)); i < e; ++i) decodeAt(i);
+    }
+}
+
+// The block whose unchecked run carries on into addr, or -1.
+int StackCPU::runsInto(int addr) const {
+    if (addr <= 0 || addr > codeSize) return -1;
+    int i = dec->blockOf[addr - 1];
+    if (i < 0 || dec->blocks[i].end != addr || !runsOn(opAt(dec->blocks[i].last))) return -1;
+    return i;
+}
+
+// A store into a verified block, or into the word the block runs on
+// into, voids its stack figures; the leader goes back to a checked op.
+// So does every block running on into a voided one, which would carry
+// on through it unchecked, and every native region holding one sends
+// its leader back to the threaded engine.
+void StackCPU::invalidate(int addr) {
+    if (addr >= codeSize) return;
+    int i = dec->blockOf[addr];
+    if (i < 0) i = runsInto(addr);
+    while (i >= 0 && dec->blocks[i].safe) {
+        own().blocks[i].safe = false;
+        ++staleBlocks;
+        for (auto&& h : regions[i]) {
+            if (!natives[h].code) continue;
+            natives[h].code = NULL;
+            decodeAt(dec->blocks[h].start);
+        }
+        regions[i].clear();
+        decodeAt(dec->blocks[i].start);
+        i = runsInto(dec->blocks[i].start);
+    }
+}
+
+// Only the first MAXDECODE words, or the whole image if it is larger,
+// are decoded; run() leaves anything beyond to the interpreter. Pages
+// holding reachable code are decoded here and marked, any other page
+// the first time control enters it. Stores outside marked pages leave
+// the decoded image alone.
+//
+// Decoding the image as loaded is kept with it, one per set of the
+// settings it depends on, for every CPU running the image after; such
+// a CPU only patches in its breakpoints and the pages it has written,
+// and copies the shared decoding on its first change.
+void StackCPU::decode() {
+    const bool looping = engine == Jit && JitCompiler::supported();
+    const int key = looping | (optimize && !profiling && !tracer && !journaling) << 1
+        | !watchpoints.empty() << 2;
+    const bool image = mem.image() == ftimage && memSize == ftimage->size()
+        && wordBits == ftimage->bits();
+    jit.clear();
+    staleBlocks = 0;
+    profCounts.clear();
+    ownDec.reset();
+    dec = image ? ftimage->decoding(key) : NULL;
+    if (dec) {
+        codeSize = dec->size;
+        NativeBlock none = { NULL, 0, 0, 0, 0, 0 };
+        natives.assign(dec->blocks.size(), none);
+        regions.assign(dec->blocks.size(), vector<int>());
+        hits.assign(dec->blocks.size(), 0);
+        profCounts.assign(profiling ? codeSize + 2 : 0, 0);
+        codeValid = true;
+        decodePages(mem.dirty());
+        for (auto&& bp : breakpoints) redecode(bp.first);
+        return;
+    }
+    ownDec = make_shared<Decoding>();
+    dec = ownDec;
+    Decoding &d = *ownDec;
+    codeSize = d.size = min(memSize, max(MAXDECODE, ftimage->extent()));
+    vector<Diagnostic> unused;
+    verify([this](int a) { return getMem(a); }, [this](int a) { return mem.instruction(a); },
+           codeSize, &d.blocks, &unused);
+    vector<Block> &blocks = d.blocks;
+    d.blockAt.assign(codeSize, -1);
+    d.blockOf.assign(codeSize, -1);
+    NativeBlock none = { NULL, 0, 0, 0, 0, 0 };
+    natives.assign(blocks.size(), none);
+    regions.assign(blocks.size(), vector<int>());
+    hits.assign(blocks.size(), 0);
+    // the Jit engine compiles loops whole, so it needs every block
+    // between a backward IF and its target as a leader
+    vector<int> looped(codeSize + 1, 0);
+    if (looping) {
+        for (auto&& b : blocks) {
+            if (opAt(b.last) != OP_IF) continue;
+            int t = getMem(b.last + 1);
+            if (t < 0 || t > b.last) continue;
+            ++looped[t];
+            --looped[b.last + 1];
+        }
+        for (int a = 1; a <= codeSize; ++a) looped[a] += looped[a - 1];
+    }
+    auto shortest = [&](const Block &b) { return looped[b.start] > 0 ? 1 : MINBLOCK; };
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        Block &b = blocks[i];
+        if (b.count < shortest(b)) {
+            b.safe = false;
+            continue;
+        }
+        // an unchecked run carries on into the next leader; take in the
+        // blocks there that are too short to check their own figures
+        for (size_t k = i + 1; k < blocks.size() && blocks[k].start == b.end
+                && blocks[k].count < shortest(blocks[k]) && runsOn(opAt(b.last)); ++k) {
+            extend(&b, blocks[k]);
+        }
+        d.blockAt[b.start] = i;
+        for (int a = b.start; a < b.end; ++a) {
+            // words on two decode paths would need both blocks voided
+            // by a store, leave them checked
+            if (d.blockOf[a] >= 0) {
+                b.safe = false;
+                blocks[d.blockOf[a]].safe = false;
+            } else {
+                d.blockOf[a] = i;
+            }
+        }
+    }
+    // nor may a block run on unchecked into one left checked
+    for (size_t i = blocks.size(); i-- > 0; ) {
+        int j = runsInto(blocks[i].start);
+        if (j >= 0 && !blocks[i].safe) blocks[j].safe = false;
+    }
+    d.codePages.assign((codeSize >> PAGESHIFT) + 2, false);
+    for (auto&& b : blocks) {
+        for (int p = b.start >> PAGESHIFT; p <= (b.end - 1) >> PAGESHIFT; ++p) d.codePages[p] = true;
+    }
+    // two trailing entries catch sequential flow running off the end
+    // of the decoded region, so the dispatch loop needs no per-step
+    // bounds check
+    d.code.resize(codeSize + 2);
+    Insn lazy = { OP_DECODE, 0 };
+    fill(d.code.begin(), d.code.begin() + codeSize, lazy);
+    for (int p = 0; p << PAGESHIFT < codeSize; ++p) {
+        if (d.codePages[p]) decodePage(p);
+    }
+    d.code[codeSize].op = OP_OOB;
+    d.code[codeSize + 1].op = OP_OOB;
+    profCounts.assign(profiling ? codeSize + 2 : 0, 0);
+    codeValid = true;
+    // only what the image itself decodes to is worth sharing
+    if (image && mem.dirty().empty() && breakpoints.empty()) {
+        ftimage->setDecoding(key, dec);
+        ownDec.reset();
+    }
+}
+
+// The decoded image to change, copied first while it is shared.
+Decoding &StackCPU::own() {
+    if (!ownDec) {
+        ownDec = make_shared<Decoding>(*dec);
+        dec = ownDec;
+    }
+    return *ownDec;
+}
+
+#if defined(__GNUC__)
+#define OPCASE(n) L_##n
+#define DISPATCH() if (++n > end) goto budget; HOOK(); goto *labels[c[pc].op]
+#define REDISPATCH(x) goto *labels[x]
+// unchecked handlers, entered through OP_BLOCK only
+#define FASTCASE(n) F_##n
+#define FASTDISPATCH() if (++n > end) goto budget; HOOK(); goto *fast[c[pc].op]
+#else
+#define OPCASE(n) case n
+#define DISPATCH() continue
+#define REDISPATCH(x) do { op = x; goto redo; } while (0)
+#endif
+// account for the k instructions of a fused op, or run only its first
+// op if they would overrun the budget
+#define FUSED(k, first) if (n + (k) - 1 > end) REDISPATCH(first); n += (k) - 1
+// A profiled run counts each instruction at its address as it is
+// dispatched, along with the stack depths the one before left, and
+// brings the profile's total up to date for each CALL, EXIT and R> so
+// it can follow the subroutines. A traced run writes the record of the
+// instruction before, now that its top of stack is known; stores write
+// their own. A journaled run records each instruction whose stack
+// entries are there to record; any other fails before it runs.
+// UNHOOK() takes all of it back for an instruction that stops before
+// running. Unhooked runs compile all of it away.
+#define HOOK() if (hooked) { \
+        if (cnt) { \
+            ++cnt[pc]; \
+            if (n > n0 + 1) { \
+                if (dp > dtop) dtop = dp; \
+                if (rp > rtop) rtop = rp; \
+            } \
+        } \
+        if (tr) { \
+            if (last >= 0) tr->put(last, mem.read(last) - 0xff00, dp ? d[dp - 1] : 0); \
+            last = pc; \
+        } \
+        if (journaling) { \
+            jop = mem.read(pc) - 0xff00; \
+            journaled = static_cast<unsigned>(jop) < OPL && opStackFits(opcodes[jop], dp, rp); \
+            if (journaled) record(opcodes[jop], pc, dp, rp); \
+        } \
+    }
+#define UNHOOK() if (hooked) { \
+        if (cnt) --cnt[pc]; \
+        last = -1; \
+        if (journaled) unrecord(); \
+        journaled = false; \
+    }
+#define TRACESTORE(a) if (hooked && tr) { \
+        tr->put(pc, OP_STORE, dp ? d[dp - 1] : 0, a, d[dp]); \
+        last = -1; \
+    }
+#define PROFILE(call) if (hooked && cnt) { \
+        prof.elapse(n - synced); \
+        synced = n; \
+        prof.after(call, dp, rp); \
+    }
+// a store into a word with counts charges them to the opcode it held
+// stores, lazy decoding and tiering up may leave the CPU its own copy
+// of a shared decoding to carry on in
+#define RELOAD() do { \
+        c = dec->code.data(); \
+        bl = dec->blocks.data(); \
+        at = dec->blockAt.data(); \
+    } while (0)
+#define RECOUNT(a) if (hooked && cnt && static_cast<unsigned>(a) < csize && cnt[a]) { \
+        prof.charge(a, mem.read(a), cnt[a]); \
+        cnt[a] = 0; \
+    }
+
+// gcc merges the identical dispatch tails of the handlers, leaving a
+// few shared indirect jumps that predict far worse than one per handler
+template <bool hooked>
+#if defined(__GNUC__) && !defined(__clang__)
+__attribute__((optimize("no-crossjumping")))
+#endif
+// Runs until a stop, or returns true with StopNone when control leaves
+// the decoded region. A verified block whose stack figures fit the
+// depths on entry runs its stack ops without checks, up to the first
+// jump, store or other op that has no unchecked handler. The hooked
+// form feeds the profile and the trace as it goes, see HOOK().
+bool StackCPU::runThreaded(long long end) {
+    const Insn *c = dec->code.data();
+    const Block *bl = dec->blocks.data();
+    const int *at = dec->blockAt.data();
+    const Block *b;
+    const NativeBlock *nb;
+    NativeExit nx;
+    int *hot = hits.data();
+    int blk;
+    // native blocks would run past breakpoints and hooks
+    const bool native = engine == Jit && JitCompiler::supported() && breakpoints.empty() && !hooked;
+    const unsigned csize = codeSize;
+    const int s = shift;
+    int pc = fpc;
+    int *d = ds, *r = rs;
+    int dp = dsp, rp = rsp;
+    long long n = steps;
+    const long long first = stop == StopBreakpoint ? steps + 1 : -1;
+    int addr, tmp;
+    long long *cnt = hooked && !profCounts.empty() ? profCounts.data() : NULL;
+    const long long n0 = n;
+    long long synced = n;
+    int dtop = 0, rtop = 0;
+    TraceWriter *tr = hooked ? tracer.get() : NULL;
+    // the instruction whose trace record waits for the next dispatch
+    int last = -1;
+    // the op journaled for the instruction dispatched, if any
+    int jop;
+    bool journaled = false;
+
+#if defined(__GNUC__)
+    static const void *labels[] = {
+        &&L_OP_LIT, &&L_OP_FETCH, &&L_OP_STORE, &&L_OP_DROP, &&L_OP_DUP,
+        &&L_OP_OVER, &&L_OP_SWAP, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_AND,
+        &&L_OP_OR, &&L_OP_XOR, &&L_OP_IF, &&L_OP_CALL, &&L_OP_EXIT,
+        &&L_OP_HALT, &&L_OP_TOR, &&L_OP_RFROM, &&L_OP_BAD, &&L_OP_OOB,
+        &&L_OP_TRAP, &&L_OP_STOREW, &&L_OP_LITADD, &&L_OP_LITSUB,
+        &&L_OP_LITFETCH, &&L_OP_LITIF, &&L_OP_DUPIF, &&L_OP_OVEROVER,
+        &&L_OP_SWAPDROP, &&L_OP_RFETCH, &&L_OP_FETCHN, &&L_OP_ADDN,
+        &&L_OP_SUBN, &&L_OP_RFROMN, &&L_OP_BLOCK, &&L_OP_JIT,
+        &&L_OP_DECODE
+    };
+    static const void *fast[] = {
+        &&F_OP_LIT, &&F_OP_FETCH, &&L_OP_STORE, &&F_OP_DROP, &&F_OP_DUP,
+        &&F_OP_OVER, &&F_OP_SWAP, &&F_OP_ADD, &&F_OP_SUB, &&F_OP_AND,
+        &&F_OP_OR, &&F_OP_XOR, &&L_OP_IF, &&L_OP_CALL, &&L_OP_EXIT,
+        &&L_OP_HALT, &&F_OP_TOR, &&F_OP_RFROM, &&L_OP_BAD, &&L_OP_OOB,
+        &&L_OP_TRAP, &&L_OP_STOREW, &&F_OP_LITADD, &&F_OP_LITSUB,
+        &&F_OP_LITFETCH, &&L_OP_LITIF, &&L_OP_DUPIF, &&F_OP_OVEROVER,
+        &&F_OP_SWAPDROP, &&F_OP_RFETCH, &&F_OP_FETCHN, &&F_OP_ADDN,
+        &&F_OP_SUBN, &&F_OP_RFROMN, &&L_OP_BLOCK, &&L_OP_JIT,
+        &&L_OP_DECODE
+    };
+    DISPATCH();
+#else
+    int op;
+    for (;;) {
+    if (++n > end) goto budget;
+    HOOK();
+    op = c[pc].op;
+redo:
+    switch (op) {
+#endif
+
+OPCASE(OP_LIT):
+    if (dp >= MAXSTACK) goto stackError;
+    d[dp++] = c[pc].arg;
+    pc += 2;
+    DISPATCH();
+OPCASE(OP_FETCH):
+    if (dp < 1) goto stackError;
+    d[dp - 1] = getMem(d[dp - 1]);
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_STORE):
+    if (dp < 2) goto stackError;
+    addr = address(d[dp - 1], s);
+    if (readOnly(addr)) goto codeError;
+    RECOUNT(addr);
+    dp -= 2;
+    setMem(addr, d[dp]);
+    RELOAD();
+    TRACESTORE(addr);
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_DROP):
+    if (dp < 1) goto stackError;
+    --dp;
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_DUP):
+    if (dp < 1 || dp >= MAXSTACK) goto stackError;
+    d[dp] = d[dp - 1];
+    ++dp;
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_OVER):
+    if (dp < 2 || dp >= MAXSTACK) goto stackError;
+    d[dp] = d[dp - 2];
+    ++dp;
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_SWAP):
+    if (dp < 2) goto stackError;
+    tmp = d[dp - 1];
+    d[dp - 1] = d[dp - 2];
+    d[dp - 2] = tmp;
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_ADD):
+    if (dp < 2) goto stackError;
+    --dp;
+    d[dp - 1] = wrapAdd(d[dp - 1], d[dp]);
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_SUB):
+    if (dp < 2) goto stackError;
+    --dp;
+    d[dp - 1] = wrapSub(d[dp - 1], d[dp]);
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_AND):
+    if (dp < 2) goto stackError;
+    --dp;
+    d[dp - 1] &= d[dp];
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_OR):
+    if (dp < 2) goto stackError;
+    --dp;
+    d[dp - 1] |= d[dp];
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_XOR):
+    if (dp < 2) goto stackError;
+    --dp;
+    d[dp - 1] ^= d[dp];
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_IF):
+    if (dp < 1) goto stackError;
+    if (d[--dp] == 0) {
+        pc = c[pc].arg;
+        if (static_cast<unsigned>(pc) >= csize) goto far;
+    } else {
+        pc += 2;
+    }
+    DISPATCH();
+OPCASE(OP_CALL):
+    if (rp >= MAXSTACK) goto stackError;
+    r[rp++] = pc + 2;
+    pc = c[pc].arg;
+    PROFILE(pc);
+    if (static_cast<unsigned>(pc) >= csize) goto far;
+    DISPATCH();
+OPCASE(OP_EXIT):
+    if (rp < 1) goto stackError;
+    pc = r[--rp];
+    PROFILE(-1);
+    if (static_cast<unsigned>(pc) >= csize) goto far;
+    DISPATCH();
+OPCASE(OP_HALT):
+    fhalt = true;
+    stop = StopHalt;
+    goto suspend;
+OPCASE(OP_TOR):
+    if (dp < 1 || rp >= MAXSTACK) goto stackError;
+    r[rp++] = d[--dp];
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_RFROM):
+    if (rp < 1 || dp >= MAXSTACK) goto stackError;
+    d[dp++] = r[--rp];
+    pc += 1;
+    PROFILE(-1);
+    DISPATCH();
+OPCASE(OP_BAD):
+    lastError = badOpcodeError(mem.read(pc));
+    lastErrorAddr = pc;
+    --n;
+    UNHOOK();
+    goto fail;
+OPCASE(OP_OOB):
+    --n;
+    UNHOOK();
+    goto far;
+OPCASE(OP_TRAP):
+    // a resumed run steps over the breakpoint it stopped at
+    if (n != first) {
+        fpc = pc;
+        dsp = dp;
+        rsp = rp;
+        steps = n - 1;
+        if (breakHit(pc)) {
+            --n;
+            UNHOOK();
+            stop = StopBreakpoint;
+            goto suspend;
+        }
+    }
+    REDISPATCH(baseOp(pc));
+OPCASE(OP_STOREW):
+    if (dp < 2) goto stackError;
+    addr = address(d[dp - 1], s);
+    if (readOnly(addr)) goto codeError;
+    RECOUNT(addr);
+    dp -= 2;
+    setMem(addr, d[dp]);
+    RELOAD();
+    TRACESTORE(addr);
+    pc += 1;
+    if (watched(addr)) {
+        watchHit = addr;
+        stop = StopWatchpoint;
+        goto suspend;
+    }
+    DISPATCH();
+OPCASE(OP_LITADD):
+    if (dp < 1 || dp >= MAXSTACK) REDISPATCH(OP_LIT);
+    FUSED(2, OP_LIT);
+    d[dp - 1] = wrapAdd(d[dp - 1], c[pc].arg);
+    pc += 3;
+    DISPATCH();
+OPCASE(OP_LITSUB):
+    if (dp < 1 || dp >= MAXSTACK) REDISPATCH(OP_LIT);
+    FUSED(2, OP_LIT);
+    d[dp - 1] = wrapSub(d[dp - 1], c[pc].arg);
+    pc += 3;
+    DISPATCH();
+OPCASE(OP_LITFETCH):
+    if (dp >= MAXSTACK) REDISPATCH(OP_LIT);
+    FUSED(2, OP_LIT);
+    d[dp++] = getMem(c[pc].arg);
+    pc += 3;
+    DISPATCH();
+OPCASE(OP_LITIF):
+    if (dp >= MAXSTACK) REDISPATCH(OP_LIT);
+    FUSED(2, OP_LIT);
+    if (c[pc].arg == 0) {
+        pc = c[pc + 2].arg;
+        if (static_cast<unsigned>(pc) >= csize) goto far;
+    } else {
+        pc += 4;
+    }
+    DISPATCH();
+OPCASE(OP_DUPIF):
+    if (dp < 1 || dp >= MAXSTACK) REDISPATCH(OP_DUP);
+    FUSED(2, OP_DUP);
+    if (d[dp - 1] == 0) {
+        pc = c[pc + 1].arg;
+        if (static_cast<unsigned>(pc) >= csize) goto far;
+    } else {
+        pc += 3;
+    }
+    DISPATCH();
+OPCASE(OP_OVEROVER):
+    if (dp < 2 || dp + 1 >= MAXSTACK) REDISPATCH(OP_OVER);
+    FUSED(2, OP_OVER);
+    d[dp] = d[dp - 2];
+    d[dp + 1] = d[dp - 1];
+    dp += 2;
+    pc += 2;
+    DISPATCH();
+OPCASE(OP_SWAPDROP):
+    if (dp < 2) REDISPATCH(OP_SWAP);
+    FUSED(2, OP_SWAP);
+    d[dp - 2] = d[dp - 1];
+    --dp;
+    pc += 2;
+    DISPATCH();
+OPCASE(OP_RFETCH):
+    if (rp < 1 || dp + 1 >= MAXSTACK) REDISPATCH(OP_RFROM);
+    FUSED(3, OP_RFROM);
+    d[dp++] = r[rp - 1];
+    pc += 3;
+    DISPATCH();
+OPCASE(OP_FETCHN):
+    if (dp < 1) goto stackError;
+    d[dp - 1] = load(d[dp - 1]);
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_ADDN):
+    if (dp < 2) goto stackError;
+    --dp;
+    d[dp - 1] = narrow(wrapAdd(d[dp - 1], d[dp]), s);
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_SUBN):
+    if (dp < 2) goto stackError;
+    --dp;
+    d[dp - 1] = narrow(wrapSub(d[dp - 1], d[dp]), s);
+    pc += 1;
+    DISPATCH();
+OPCASE(OP_RFROMN):
+    if (rp < 1 || dp >= MAXSTACK) goto stackError;
+    d[dp++] = narrow(r[--rp], s);
+    pc += 1;
+    PROFILE(-1);
+    DISPATCH();
+OPCASE(OP_BLOCK):
+    blk = at[pc];
+    b = &bl[blk];
+    if (native && ++hot[blk] == HOTBLOCK && tierUp(blk)) {
+        RELOAD();
+        REDISPATCH(OP_JIT);
+    }
+#if defined(__GNUC__)
+    if (dp >= b->dneed && dp + b->dgrow <= MAXSTACK
+            && rp >= b->rneed && rp + b->rgrow <= MAXSTACK) {
+        goto *fast[b->op];
+    }
+#endif
+    REDISPATCH(b->op);
+OPCASE(OP_JIT):
+    blk = at[pc];
+    nb = &natives[blk];
+    // the budget must cover the first block, which cannot stop half
+    // way; the region checks it for each block after
+    if (native && dp >= nb->dneed && dp + nb->dgrow <= MAXSTACK
+            && rp >= nb->rneed && rp + nb->rgrow <= MAXSTACK && end - n + 1 >= nb->count) {
+        nx.budget = end - n + 1;
+        pc = nb->code(d + dp, r + rp, this, &nx);
+        n = end - nx.budget;
+        dp += nx.ddelta;
+        rp += nx.rdelta;
+        if (static_cast<unsigned>(pc) >= csize) goto far;
+        DISPATCH();
+    }
+    REDISPATCH(OP_BLOCK);
+OPCASE(OP_DECODE):
+    decodePage(pc >> PAGESHIFT);
+    RELOAD();
+    REDISPATCH(c[pc].op);
+
+#if defined(__GNUC__)
+FASTCASE(OP_LIT):
+    d[dp++] = c[pc].arg;
+    pc += 2;
+    FASTDISPATCH();
+FASTCASE(OP_FETCH):
+    d[dp - 1] = getMem(d[dp - 1]);
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_DROP):
+    --dp;
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_DUP):
+    d[dp] = d[dp - 1];
+    ++dp;
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_OVER):
+    d[dp] = d[dp - 2];
+    ++dp;
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_SWAP):
+    tmp = d[dp - 1];
+    d[dp - 1] = d[dp - 2];
+    d[dp - 2] = tmp;
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_ADD):
+    --dp;
+    d[dp - 1] = wrapAdd(d[dp - 1], d[dp]);
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_SUB):
+    --dp;
+    d[dp - 1] = wrapSub(d[dp - 1], d[dp]);
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_AND):
+    --dp;
+    d[dp - 1] &= d[dp];
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_OR):
+    --dp;
+    d[dp - 1] |= d[dp];
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_XOR):
+    --dp;
+    d[dp - 1] ^= d[dp];
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_TOR):
+    r[rp++] = d[--dp];
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_RFROM):
+    d[dp++] = r[--rp];
+    pc += 1;
+    PROFILE(-1);
+    FASTDISPATCH();
+FASTCASE(OP_LITADD):
+    FUSED(2, OP_LIT);
+    d[dp - 1] = wrapAdd(d[dp - 1], c[pc].arg);
+    pc += 3;
+    FASTDISPATCH();
+FASTCASE(OP_LITSUB):
+    FUSED(2, OP_LIT);
+    d[dp - 1] = wrapSub(d[dp - 1], c[pc].arg);
+    pc += 3;
+    FASTDISPATCH();
+FASTCASE(OP_LITFETCH):
+    FUSED(2, OP_LIT);
+    d[dp++] = getMem(c[pc].arg);
+    pc += 3;
+    FASTDISPATCH();
+FASTCASE(OP_OVEROVER):
+    FUSED(2, OP_OVER);
+    d[dp] = d[dp - 2];
+    d[dp + 1] = d[dp - 1];
+    dp += 2;
+    pc += 2;
+    FASTDISPATCH();
+FASTCASE(OP_SWAPDROP):
+    FUSED(2, OP_SWAP);
+    d[dp - 2] = d[dp - 1];
+    --dp;
+    pc += 2;
+    FASTDISPATCH();
+FASTCASE(OP_RFETCH):
+    FUSED(3, OP_RFROM);
+    d[dp++] = r[rp - 1];
+    pc += 3;
+    FASTDISPATCH();
+FASTCASE(OP_FETCHN):
+    d[dp - 1] = load(d[dp - 1]);
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_ADDN):
+    --dp;
+    d[dp - 1] = narrow(wrapAdd(d[dp - 1], d[dp]), s);
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_SUBN):
+    --dp;
+    d[dp - 1] = narrow(wrapSub(d[dp - 1], d[dp]), s);
+    pc += 1;
+    FASTDISPATCH();
+FASTCASE(OP_RFROMN):
+    d[dp++] = narrow(r[--rp], s);
+    pc += 1;
+    PROFILE(-1);
+    FASTDISPATCH();
+#endif
+
+#if !defined(__GNUC__)
+    }
+    }
+#endif
+
+budget:
+    --n;
+    // the last op ran off the end of memory, which step() reports at once
+    if (pc < 0 || pc >= memSize) goto boundsError;
+    stop = StopBudget;
+suspend:
+    fpc = pc;
+    dsp = dp;
+    rsp = rp;
+    steps = n;
+    if (hooked) goto unhook;
+    return true;
+
+far:
+    if (pc < 0 || pc >= memSize) goto boundsError;
+    stop = StopNone;
+    goto suspend;
+
+stackError:
+    lastError = E005;
+    lastErrorAddr = pc;
+    --n;
+    UNHOOK();
+    goto fail;
+codeError:
+    lastError = E013;
+    lastErrorAddr = pc;
+    --n;
+    UNHOOK();
+    goto fail;
+boundsError:
+    lastError = E006;
+    lastErrorAddr = pc;
+fail:
+    stop = StopError;
+    fpc = pc;
+    dsp = dp;
+    rsp = rp;
+    steps = n;
+    if (hooked) goto unhook;
+    return false;
+
+unhook:
+    if (tr && last >= 0) tr->put(last, mem.read(last) - 0xff00, dp ? d[dp - 1] : 0);
+    if (cnt) {
+        prof.elapse(n - synced);
+        // the stacks as the last instruction left them
+        if (n > n0) prof.depth(max(dtop, dp), max(rtop, rp));
+        chargeCounts();
     }
-    return ret;
+    return stop != StopError;
+}
+
+// Hand the counts of a profiled threaded run over to the profile, each
+// charged to the opcode its word holds.
+void StackCPU::chargeCounts() {
+    for (int p = 0; p << PAGESHIFT < codeSize; ++p) {
+        if (!dec->codePages[p]) continue;
+        int e = min(codeSize, (p + 1) << PAGESHIFT);
+        for (int a = p << PAGESHIFT; a < e; ++a) {
+            if (!profCounts[a]) continue;
+            prof.charge(a, mem.read(a), profCounts[a]);
+            profCounts[a] = 0;
+        }
+    }
+}
+
+#undef OPCASE
+#undef DISPATCH
+#undef REDISPATCH
+#undef FUSED
+#undef HOOK
+#undef UNHOOK
+#undef TRACESTORE
+#undef PROFILE
+#undef RELOAD
+#undef RECOUNT
+#undef FASTCASE
+#undef FASTDISPATCH
+
+// Compile block i to native code along with the verified blocks its
+// jumps and calls lead to, and on from those, up to MAXREGION blocks,
+// so a loop through them runs natively; patch its leader to run it.
+bool StackCPU::tierUp(int i) {
+    vector<int> ids(1, i);
+    for (size_t k = 0; k < ids.size(); ++k) {
+        const Block &b = dec->blocks[ids[k]];
+        int next[2] = { -1, -1 };
+        int c = opAt(b.last);
+        if (c == OP_IF) {
+            next[0] = getMem(b.last + 1);
+            next[1] = b.last + 2;
+        } else if (c == OP_CALL) {
+            next[0] = getMem(b.last + 1);
+        } else if (runsOn(c)) {
+            next[0] = b.end;
+        }
+        for (auto&& a : next) {
+            if (a < 0 || a >= codeSize || ids.size() >= MAXREGION) continue;
+            int j = dec->blockAt[a];
+            if (j >= 0 && dec->blocks[j].safe && find(ids.begin(), ids.end(), j) == ids.end()) ids.push_back(j);
+        }
+    }
+    vector<Block> region;
+    for (auto&& k : ids) region.push_back(dec->blocks[k]);
+    if (!jit.compile([this](int a) { return getMem(a); }, region, fetch, wordBits, &natives[i])) return false;
+    for (auto&& k : ids) regions[k].push_back(i);
+    decodeAt(dec->blocks[i].start);
+    return true;
 }
 
+int StackCPU::fetch(const void *cpu, int addr) {
+    return static_cast<const StackCPU *>(cpu)->load(addr);
+}
+
+// Journal entry layout, oldest first: a word packing the entry's stack
+// counts, store flag and whether the stored word was code, the data
+// and return stack entries the instruction consumes, the memory word a
+// store overwrites as an address/value pair, then the PC and the
+// packed word again. The leading copy gives the length of the oldest
+// entry, so it can be dropped.
+#define JDSI(n) ((n) & 0xf)
+#define JDSO(n) (((n) >> 4) & 0xf)
+#define JRSI(n) (((n) >> 8) & 0xf)
+#define JRSO(n) (((n) >> 12) & 0xf)
+#define JMEM(n) (((n) >> 16) & 1)
+#define JTAG(n) (((n) >> 17) & 1)
+#define JLEN(n) (JDSI(n) + JRSI(n) + JMEM(n) * 2 + 3)
+
+// Journal op about to run at pc with the stacks at depths dp and rp,
+// which it must fit.
+void StackCPU::record(const Opcode &op, int pc, int dp, int rp) {
+    int n = op.dsi | op.dso << 4 | op.rsi << 8 | op.rso << 12;
+    size_t head = journal.size();
+    journal.push_back(n);
+    for (int i = dp - op.dsi; i < dp; ++i) journal.push_back(ds[i]);
+    for (int i = rp - op.rsi; i < rp; ++i) journal.push_back(rs[i]);
+    if (op.opc == 0xff02) {
+        int addr = address(ds[dp - 1], shift);
+        if (addr >= 0 && addr < memSize) {
+            journal.push_back(addr);
+            journal.push_back(mem.read(addr));
+            n |= 1 << 16 | mem.instruction(addr) << 17;
+            journal[head] = n;
+        }
+    }
+    journal.push_back(pc);
+    journal.push_back(n);
+    while (journal.size() > MAXJOURNAL) {
+        journal.erase(journal.begin(), journal.begin() + JLEN(journal.front()));
+    }
+}
+
+// Drop the newest entry, for an instruction that stopped before it ran.
+void StackCPU::unrecord() {
+    journal.resize(journal.size() - JLEN(journal.back()));
+}
+
+// Undo the last instruction. The journal holds at most MAXJOURNAL
+// words, dropping the oldest steps first, so only about the last few
+// million instructions of a run can be undone; past them stepBack()
+// returns false as it does at the reset.
+bool StackCPU::stepBack() {
+    if (journal.empty()) return false;
+    int n = journal.back();
+    journal.pop_back();
+    fpc = journal.back();
+    journal.pop_back();
+    if (JMEM(n)) {
+        int val = journal.back();
+        journal.pop_back();
+        int addr = journal.back();
+        journal.pop_back();
+        setMem(addr, val);
+        // and take back the tag the store gave it, see setMem()
+        if (!JTAG(n) && mem.instruction(addr)) {
+            mem.untag(addr);
+            if (codeValid && isCode(addr)) {
+                invalidate(addr);
+                redecode(addr);
+            }
+        }
+    }
+    rsp -= JRSO(n);
+    dsp -= JDSO(n);
+    copy(journal.end() - JRSI(n), journal.end(), rs + rsp);
+    rsp += JRSI(n);
+    journal.resize(journal.size() - JRSI(n));
+    copy(journal.end() - JDSI(n), journal.end(), ds + dsp);
+    dsp += JDSI(n);
+    journal.resize(journal.size() - JDSI(n) - 1);
+    fhalt = false;
+    stop = StopNone;
+    --steps;
+    return true;
+}
+
+// Undo instructions until count have been executed since the reset.
+// Only the journal is replayed, so the cost is proportional to the
+// distance travelled back, not to the length of the run.
+bool StackCPU::stepBackTo(long long count) {
+    while (steps > count) {
+        if (!stepBack()) return false;
+    }
+    return steps == count;
+}
+
+// Step back to the previous breakpoint hit, or as far as the journal
+// reaches.
+bool StackCPU::runBack() {
+    if (!stepBack()) return false;
+    while (breakpoints.empty() || !breakHit(fpc)) {
+        if (!stepBack()) break;
+    }
+    return true;
+}
+
+// One source line assembled on its own, as it would assemble after a
+// line leaving pendingIn operands to fill. Words at label references
+// hold 0 until link(). Assembly stops at error, so every definition
+// comes before it.
+struct StackCPU::Fragment {
+    struct Label {
+        int at;
+        int id;
+        int col;
+    };
+
+    int pendingIn, pendingOut;
+    vector<int> words;
+    // offsets of the opcode words
+    vector<int> ops;
+    vector<Label> defs, refs;
+    // the error that stops assembly, and the first unknown word
+    const char *error;
+    int errorAt, errorCol;
+    string errorWord;
+    int badAt, badCol;
+    string badWord;
+};
+
+int StackCPU::labelId(const Token &t) {
+    auto it = labelIds.emplace(string(t.s, t.len), (int) labelNames.size());
+    if (it.second) labelNames.push_back(it.first->first);
+    return it.first->second;
+}
+
+// Assembles line as assemble() would, token by token, but keeps label
+// definitions and references by id for link().
+shared_ptr<const StackCPU::Fragment> StackCPU::assembleLine(const string &line, int pending) {
+    shared_ptr<Fragment> f = make_shared<Fragment>();
+    f->pendingIn = pending;
+    f->error = NULL;
+    f->badAt = -1;
+    lineTok.scan(line.data(), line.size());
+    lineTok.scan("\n", 1);
+    for (auto&& t : lineTok.tokens()) {
+        int at = f->words.size();
+        long long l;
+        if (pending > 0) {
+            --pending;
+            if (t.s[0] == ':') {
+                Fragment::Label r = { at, labelId(t), t.col };
+                f->refs.push_back(r);
+                l = 0;
+            } else if (!tryNumToInt(t.s, &l)) {
+                f->error = E002;
+            } else if (!fits(l, fragBits)) {
+                f->error = E004;
+            }
+            if (f->error) {
+                f->errorAt = at;
+                f->errorCol = t.col;
+                f->errorWord.assign(t.s, t.len);
+                break;
+            }
+        } else if (t.s[0] == ':') {
+            Fragment::Label d = { at, labelId(t), t.col };
+            f->defs.push_back(d);
+            continue;
+        } else if (const Opcode *op = opFind(t.s, t.len)) {
+            pending = max(op->pci - 1, 0);
+            l = op->opc;
+            f->ops.push_back(at);
+        } else if (!tryNumToInt(t.s, &l)) {
+            if (f->badAt < 0) {
+                f->badAt = at;
+                f->badCol = t.col;
+                f->badWord.assign(t.s, t.len);
+            }
+            l = 0;
+        } else if (!fits(l, fragBits)) {
+            f->error = E004;
+            f->errorAt = at;
+            f->errorCol = t.col;
+            f->errorWord.assign(t.s, t.len);
+            break;
+        }
+        f->words.push_back(static_cast<int>(l));
+    }
+    lineTok.drop();
+    f->pendingOut = pending;
+    return f;
+}
+
+// Lays out the fragments of the first n lines, resolves labels and
+// builds the image, reporting errors in the order assemble() does.
+bool StackCPU::link(size_t n) {
+    vector<int> addrs(labelNames.size(), -1);
+    size_t size = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const Fragment &f = *frags[i];
+        // references to labels defined earlier must fit the width; they
+        // are checked in source order with the definitions, as assemble()
+        // checks them
+        size_t k = 0;
+        auto backRefs = [&](int end) {
+            for (; k < f.refs.size() && f.refs[k].at < end; ++k) {
+                const Fragment::Label &r = f.refs[k];
+                if (addrs[r.id] < 0 || fits(addrs[r.id], wordBits)) continue;
+                const string &w = labelNames[r.id];
+                Token t = { w.c_str(), static_cast<int>(w.size()), static_cast<int>(i + 1), r.col };
+                compileError(E004, t, size + r.at);
+                return false;
+            }
+            return true;
+        };
+        for (auto&& d : f.defs) {
+            if (!backRefs(d.at)) return false;
+            if (addrs[d.id] >= 0) {
+                const string &w = labelNames[d.id];
+                Token t = { w.c_str(), static_cast<int>(w.size()), static_cast<int>(i + 1), d.col };
+                compileError(E001, t, size + d.at);
+                return false;
+            }
+            addrs[d.id] = size + d.at;
+        }
+        if (!backRefs(INT_MAX)) return false;
+        if (f.error) {
+            Token t = { f.errorWord.c_str(), static_cast<int>(f.errorWord.size()),
+                        static_cast<int>(i + 1), f.errorCol };
+            compileError(f.error, t, size + f.errorAt);
+            return false;
+        }
+        size += f.words.size();
+    }
+
+    // the first unknown word, or undeclared label or one out of range
+    const string *bad = NULL;
+    const char *badError = E002;
+    int badAddr = 0, badLine = 0, badCol = 0;
+    bool undeclared = false;
+    size_t addr = 0;
+    for (size_t i = 0; i < n && !undeclared; ++i) {
+        const Fragment &f = *frags[i];
+        if (!bad && f.badAt >= 0) {
+            bad = &f.badWord;
+            badAddr = addr + f.badAt;
+            badLine = i + 1;
+            badCol = f.badCol;
+        }
+        for (auto&& r : f.refs) {
+            if (addrs[r.id] >= 0 && fits(addrs[r.id], wordBits)) continue;
+            if (!bad || (int) addr + r.at < badAddr) {
+                bad = &labelNames[r.id];
+                badError = addrs[r.id] < 0 ? E003 : E004;
+                badAddr = addr + r.at;
+                badLine = i + 1;
+                badCol = r.col;
+            }
+            undeclared = true;
+            break;
+        }
+        addr += f.words.size();
+    }
+    if (bad) {
+        Token t = { bad->c_str(), static_cast<int>(bad->size()), badLine, badCol };
+        compileError(badError, t, badAddr);
+        return false;
+    }
+
+    if (size > (size_t) memSize) {
+        lastError = E008;
+        lastErrorAddr = memSize;
+        lastErrorLine = 0;
+        return false;
+    }
+    vector<int> words;
+    words.reserve(size);
+    vector<unsigned char> tags(size / 8 + 1);
+    vector<Symbol> syms;
+    for (size_t i = 0; i < n; ++i) {
+        const Fragment &f = *frags[i];
+        int base = words.size();
+        words.insert(words.end(), f.words.begin(), f.words.end());
+        for (auto&& r : f.refs) words[base + r.at] = addrs[r.id];
+        for (auto&& o : f.ops) tags[(base + o) >> 3] |= 1 << ((base + o) & 7);
+        // definitions come in address order; those sharing an address
+        // sort by name
+        for (auto&& d : f.defs) {
+            Symbol s = { labelNames[d.id].substr(1), base + d.at };
+            auto it = syms.end();
+            while (it != syms.begin() && (it - 1)->addr == s.addr && s.name < (it - 1)->name) --it;
+            syms.insert(it, move(s));
+        }
+    }
+    ftimage = make_shared<const Image>(move(words), memSize, move(syms), wordBits, move(tags));
+    diagsValid = false;
+    return true;
+}
+
+// Assembles lines. Lines compiled before, unchanged or found again in
+// the cache, are not assembled again; only the layout, labels and
+// image are redone.
 bool StackCPU::compile() {
-    lineReconstruct();
-    if (!preprocessing()) return false;
-    if (!processing()) return false;
+    // numbers are checked against the word width as lines assemble
+    if (wordBits != fragBits) {
+        frags.clear();
+        fragCache[0].clear();
+        fragCache[1].clear();
+        fragBits = wordBits;
+    }
+    frags.resize(lines->size());
+    size_t n = 0;
+    int pending = 0;
+    while (n < lines->size()) {
+        shared_ptr<const Fragment> &f = frags[n];
+        const string &l = (*lines)[n++];
+        if (!f || f->pendingIn != pending) {
+            shared_ptr<const Fragment> &c = fragCache[pending][l];
+            if (!c) c = assembleLine(l, pending);
+            f = c;
+        }
+        if (f->error) break;
+        pending = f->pendingOut;
+    }
+    // keep the cache to about what the lines use
+    if (fragCache[0].size() + fragCache[1].size() > 2 * lines->size() + MAXFRAGCACHE) {
+        fragCache[0].clear();
+        fragCache[1].clear();
+        for (size_t i = 0; i < n; ++i) fragCache[frags[i]->pendingIn][(*lines)[i]] = frags[i];
+    }
+    return link(n);
+}
+
+// Assembles the source as it is read, without holding all of it.
+bool StackCPU::compile(istream &in) {
+    vector<char> buf(COMPILECHUNK);
+    beginCompile();
+    while (in.read(buf.data(), buf.size()) || in.gcount() > 0) {
+        if (!compileChunk(buf.data(), in.gcount())) break;
+    }
+    if (in.bad()) {
+        assembly.reset();
+        char buff[255];
+        snprintf(buff, sizeof(buff), E012, "read error");
+        lastError = buff;
+        lastErrorAddr = 0;
+        lastErrorLine = 0;
+        return false;
+    }
+    return endCompile();
+}
+
+// As compile(istream &), reading a file descriptor such as a pipe.
+bool StackCPU::compile(int fd) {
+    vector<char> buf(COMPILECHUNK);
+    beginCompile();
+    for (;;) {
+#ifdef _WIN32
+        int n = _read(fd, buf.data(), buf.size());
+#else
+        ssize_t n = read(fd, buf.data(), buf.size());
+        if (n < 0 && errno == EINTR) continue;
+#endif
+        if (n < 0) {
+            assembly.reset();
+            char buff[255];
+            snprintf(buff, sizeof(buff), E012, strerror(errno));
+            lastError = buff;
+            lastErrorAddr = 0;
+            lastErrorLine = 0;
+            return false;
+        }
+        if (n == 0 || !compileChunk(buf.data(), n)) break;
+    }
+    return endCompile();
+}
+
+bool StackCPU::saveImage(const string &path) {
+    string why;
+    if (ftimage->save(path, &why)) return true;
+    char buff[255];
+    snprintf(buff, sizeof(buff), E009, why.c_str());
+    lastError = buff;
+    lastErrorAddr = 0;
+    lastErrorLine = 0;
+    return false;
+}
+
+// Use a saved image in place of compile(); the memory size comes from
+// the image.
+bool StackCPU::loadImage(const string &path) {
+    string why;
+    shared_ptr<const Image> img = Image::open(path, &why);
+    if (!img) {
+        char buff[255];
+        snprintf(buff, sizeof(buff), E010, why.c_str());
+        lastError = buff;
+        lastErrorAddr = 0;
+        lastErrorLine = 0;
+        return false;
+    }
+    ftimage = img;
+    memSize = img->size();
+    setWordBits(img->bits());
+    diags.clear();
+    diagsValid = true;
     return true;
 }
 
 void StackCPU::clearStack() {
-    ds->clear();
-    rs->clear();
+    dsp = 0;
+    rsp = 0;
     fpc = 0;
     fhalt = false;
-    delete[] mem;
-    mem = new int[memSize];
-    memcpy(mem, ftmem, memSize * sizeof(int));
+    stop = StopNone;
+    steps = 0;
+    journal.clear();
+    if (tracer) tracer->put(0, TRACERESET, 0);
+    // resetting to the same image only rewrites the pages written since
+    // the last reset, and the decoded image is patched to match
+    vector<int> restored;
+    bool same = mem.image() == ftimage && memSize == ftimage->size() && wordBits == ftimage->bits();
+    mem.load(ftimage, &restored);
+    memSize = ftimage->size();
+    wordBits = ftimage->bits();
+    shift = 32 - wordBits;
+    prof.clear(profiling ? ftimage->extent() : 0);
+    if (same && codeValid) {
+        decodePages(restored);
+        // verify again rather than run the program checked
+        if (staleBlocks) codeValid = false;
+    } else {
+        codeValid = false;
+    }
 }
 
-bool StackCPU::run() {
+// Run until HALT, an error, a breakpoint, a watched store or, when
+// maxInstructions is not negative, until that many instructions have
+// executed; returns false only on error, see stopReason(). A run resumed
+// at a breakpoint executes that instruction instead of stopping again.
+bool StackCPU::run(long long maxInstructions) {
+    const long long end = maxInstructions < 0 ? LLONG_MAX : steps + maxInstructions;
+    bool first = stop == StopBreakpoint;
     while (!fhalt) {
+        // a run resumed after the PC left memory stops there again
+        if (fpc < 0 || fpc >= memSize) {
+            lastError = E006;
+            lastErrorAddr = fpc;
+            stop = StopError;
+            return false;
+        }
+        if (engine != Interpreter) {
+            if (!codeValid) decode();
+            if (fpc < codeSize) {
+                bool hooked = profiling || tracer || journaling;
+                if (!(hooked ? runThreaded<true>(end) : runThreaded<false>(end))) return false;
+                if (stop != StopNone) return true;
+                first = false;
+                continue;
+            }
+        }
+        if (steps >= end) {
+            stop = StopBudget;
+            return true;
+        }
+        if (!first && !breakpoints.empty() && breakHit(fpc)) {
+            stop = StopBreakpoint;
+            return true;
+        }
+        first = false;
         if (!step()) return false;
+        if (stop == StopWatchpoint) return true;
     }
+    stop = StopHalt;
     return true;
 }
 
+// Run in slices of SLICE instructions until the deadline passes; stops
+// with StopBudget if it does, without running at all if it already
+// has. A CPU already stopped at a halt, error or breakpoint keeps that
+// reason then.
+bool StackCPU::runUntil(chrono::steady_clock::time_point deadline) {
+    while (chrono::steady_clock::now() < deadline) {
+        if (!run(SLICE)) return false;
+        if (stop != StopBudget) return true;
+    }
+    if (stop == StopNone) stop = StopBudget;
+    return stop != StopError;
+}
+
 bool StackCPU::stepInto() {
     return step();
 }
 
 bool StackCPU::stepOver() {
-    int t = mem[fpc] == 0xff0d ? 1 : 0;
+    int t = opAt(fpc) == OP_CALL ? 1 : 0;
     if (!step()) return false;
-    while (!fhalt && t > 0) {
-        if (mem[fpc] == 0xff0d) ++t;
-        else if (mem[fpc] == 0xff0e) --t;
+    while (!fhalt && t > 0 && stop != StopWatchpoint) {
+        if (!breakpoints.empty() && breakHit(fpc)) {
+            stop = StopBreakpoint;
+            break;
+        }
+        if (opAt(fpc) == OP_CALL) ++t;
+        else if (opAt(fpc) == OP_EXIT) --t;
         if (!step()) return false;
     }
     return true;
@@ -473,12 +2104,41 @@ bool StackCPU::stepOver() {
 void StackCPU::setLines(vector<string> l) {
     lines->clear();
     lines->insert(lines->end(), l.begin(), l.end());
+    frags.clear();
+}
+
+// Replaces count lines from first with the given ones, as an edit
+// does; the next compile() assembles only those.
+void StackCPU::replaceLines(int first, int count, vector<string> with) {
+    if (first < 0 || count < 0 || first + count > (int) lines->size()) return;
+    lines->erase(lines->begin() + first, lines->begin() + first + count);
+    lines->insert(lines->begin() + first, with.begin(), with.end());
+    if (frags.size() < (size_t) first + count) frags.resize(first + count);
+    frags.erase(frags.begin() + first, frags.begin() + first + count);
+    frags.insert(frags.begin() + first, with.size(), nullptr);
 }
 
 vector<string> *StackCPU::getLines() const {
     return lines;
 }
 
+// Stack errors found by verify() in the last compiled program, lowest
+// address first. Found on first use rather than by each compile(),
+// which an editor may run on every change.
+const vector<Diagnostic> &StackCPU::diagnostics() const {
+    if (!diagsValid) {
+        const Image &img = *ftimage;
+        vector<Block> bl;
+        verify([&img](int a) { return a < img.extent() ? img.data()[a] : 0; },
+               [&img](int a) {
+                   return !img.tags() || (a < img.extent() && (img.tags()[a >> 3] >> (a & 7) & 1));
+               },
+               min(img.size(), max(MAXDECODE, img.extent())), &bl, &diags);
+        diagsValid = true;
+    }
+    return diags;
+}
+
 string StackCPU::error() const {
     return lastError;
 }
@@ -487,6 +2147,10 @@ int StackCPU::errorAddr() const {
     return lastErrorAddr;
 }
 
+int StackCPU::errorLine() const {
+    return lastErrorLine;
+}
+
 int StackCPU::pc() const {
     return fpc;
 }
@@ -495,16 +2159,14 @@ bool StackCPU::halt() const {
     return fhalt;
 }
 
-vector<int> StackCPU::dataStack() const {
-    vector<int> lst;
-    for (int &x : (*ds)) lst.push_back(x);
-    return lst;
+StackView StackCPU::dataStack() const {
+    StackView v = { ds, dsp };
+    return v;
 }
 
-vector<int> StackCPU::returnStack() const {
-    vector<int> lst;
-    for (int &x : (*rs)) lst.push_back(x);
-    return lst;
+StackView StackCPU::returnStack() const {
+    StackView v = { rs, rsp };
+    return v;
 }
 
 int StackCPU::getMemSize() const {
@@ -513,8 +2175,262 @@ int StackCPU::getMemSize() const {
 
 void StackCPU::setMemSize(int val) {
     memSize = val;
+    codeValid = false;
+}
+
+int StackCPU::getWordBits() const {
+    return wordBits;
+}
+
+// Width of data words, 8, 16 or 32 bits; other widths are ignored.
+// Like the memory size, it applies to the next compile and comes from
+// the image on reset.
+void StackCPU::setWordBits(int val) {
+    if (val != 8 && val != 16 && val != 32) return;
+    wordBits = val;
+    shift = 32 - val;
+    codeValid = false;
 }
 
 int StackCPU::memory(int i) const {
-    return mem[i];
+    return mem.read(i);
+}
+
+// Whether the word at addr may run as an instruction: one the assembler
+// tagged as an opcode or one since written into a page holding code,
+// or any word of an untagged image; see Image::tags(). While code is
+// protected tags stay as assembled.
+bool StackCPU::instruction(int addr) const {
+    return addr >= 0 && addr < memSize && mem.instruction(addr);
+}
+
+// Whether addr leads a block the engines run without checking the
+// stacks on each instruction, as last decoded. Never so under the
+// Interpreter, which decodes nothing.
+bool StackCPU::unchecked(int addr) const {
+    if (!codeValid || addr < 0 || addr >= codeSize) return false;
+    int op = dec->code[addr].op;
+    return op == OP_BLOCK || op == OP_JIT;
+}
+
+void StackCPU::setMemory(int i, int val) {
+    setMem(i, val);
+}
+
+shared_ptr<const Image> StackCPU::image() const {
+    return ftimage;
+}
+
+// The image memory was last reset to, which image() is not until
+// clearStack() after a compile or load.
+shared_ptr<const Image> StackCPU::loadedImage() const {
+    return mem.image();
+}
+
+// Pages of memory that differ from loadedImage(); every other word
+// reads as the image has it.
+const vector<int> &StackCPU::dirtyPages() const {
+    return mem.dirty();
+}
+
+// Capture registers, stacks and the pages written since the last
+// reset. Both snapshot() and restore() cost time proportional to the
+// number of dirty pages, not to the memory size.
+Snapshot StackCPU::snapshot() const {
+    Snapshot snap;
+    snap.base = mem.image();
+    mem.save(&snap.pages, &snap.words);
+    snap.ds.assign(ds, ds + dsp);
+    snap.rs.assign(rs, rs + rsp);
+    snap.fpc = fpc;
+    snap.fhalt = fhalt;
+    snap.steps = steps;
+    snap.stop = stop;
+    snap.watchHit = watchHit;
+    snap.lastError = lastError;
+    snap.lastErrorAddr = lastErrorAddr;
+    return snap;
+}
+
+bool StackCPU::restore(const Snapshot &snap) {
+    if (snap.base != mem.image()) return false;
+    vector<int> restored;
+    if (!mem.restore(snap.pages, snap.words, &restored)) return false;
+    if (codeValid) decodePages(restored);
+    if (staleBlocks) codeValid = false;
+    dsp = snap.ds.size();
+    rsp = snap.rs.size();
+    copy(snap.ds.begin(), snap.ds.end(), ds);
+    copy(snap.rs.begin(), snap.rs.end(), rs);
+    fpc = snap.fpc;
+    fhalt = snap.fhalt;
+    steps = snap.steps;
+    stop = static_cast<StopReason>(snap.stop);
+    watchHit = snap.watchHit;
+    lastError = snap.lastError;
+    lastErrorAddr = snap.lastErrorAddr;
+    journal.clear();
+    return true;
+}
+
+
+StackCPU::Engine StackCPU::getEngine() const {
+    return engine;
+}
+
+void StackCPU::setEngine(Engine val) {
+    // the Jit engine verifies shorter blocks
+    if (val != engine) codeValid = false;
+    engine = val;
+}
+
+StackCPU::StopReason StackCPU::stopReason() const {
+    return stop;
+}
+
+int StackCPU::watchAddr() const {
+    return watchHit;
+}
+
+// Stop before executing addr, or only when cond returns true for the
+// CPU state at that point.
+void StackCPU::setBreakpoint(int addr, function<bool(const StackCPU &)> cond) {
+    breakpoints[addr] = cond;
+    redecode(addr);
+}
+
+void StackCPU::clearBreakpoint(int addr) {
+    breakpoints.erase(addr);
+    redecode(addr);
+}
+
+// Decode addr again, and any fused op that may reach it.
+void StackCPU::redecode(int addr) {
+    if (!codeValid || addr < 0 || addr >= memSize) return;
+    for (int i = max(0, addr - (MAXFUSE - 1)); i <= addr; ++i) decodeAt(i);
+}
+
+void StackCPU::clearBreakpoints() {
+    breakpoints.clear();
+    codeValid = false;
+}
+
+bool StackCPU::hasBreakpoint(int addr) const {
+    return breakpoints.count(addr) != 0;
+}
+
+// Stop after any store to an address in [lo, hi].
+void StackCPU::addWatchpoint(int lo, int hi) {
+    watchpoints.push_back(make_pair(lo, hi));
+    codeValid = false;
+}
+
+void StackCPU::clearWatchpoints() {
+    watchpoints.clear();
+    codeValid = false;
+}
+
+bool StackCPU::breakHit(int addr) const {
+    auto it = breakpoints.find(addr);
+    return it != breakpoints.end() && (!it->second || it->second(*this));
+}
+
+bool StackCPU::watched(int addr) const {
+    for (auto&& w : watchpoints) {
+        if (addr >= w.first && addr <= w.second) return true;
+    }
+    return false;
+}
+
+bool StackCPU::getOptimize() const {
+    return optimize;
+}
+
+bool StackCPU::getProtectCode() const {
+    return protectCode;
+}
+
+// Make opcodes and their operands read-only to the program: ! into
+// them stops with an error, and no store makes data code. Off by
+// default, so programs may modify their own code; only tagged images
+// know which words are code.
+void StackCPU::setProtectCode(bool val) {
+    protectCode = val;
+}
+
+// Fuse common instruction sequences into superinstructions in the
+// threaded engine. Memory, stepping and error reporting are unaffected.
+void StackCPU::setOptimize(bool val) {
+    optimize = val;
+    codeValid = false;
+}
+
+long long StackCPU::instructionCount() const {
+    return steps;
+}
+
+bool StackCPU::getJournal() const {
+    return journaling;
+}
+
+// Record an undo journal as instructions run, making stepBack() and
+// friends available. The threaded engine records it too, running
+// without superinstructions or native code while it is on.
+void StackCPU::setJournal(bool val) {
+    if (val != journaling) codeValid = false;
+    journaling = val;
+    if (!val) journal.clear();
+}
+
+bool StackCPU::getProfiling() const {
+    return profiling;
+}
+
+// Count instructions per address, opcode and subroutine, see Profile.
+// The threaded engine counts as it runs, with superinstructions and
+// native code off; the counts start over when profiling is turned on
+// and with clearStack().
+void StackCPU::setProfiling(bool val) {
+    if (val != profiling) codeValid = false;
+    profiling = val;
+    if (val) prof.clear(ftimage->extent());
+}
+
+const Profile &StackCPU::profile() const {
+    return prof;
+}
+
+// Stream every instruction executed from now on to a trace file, see
+// TraceWriter; clearStack() is recorded too. Until stopTrace() the
+// threaded engine runs without superinstructions or native code, so
+// every instruction gets its record.
+bool StackCPU::startTrace(const string &path) {
+    string why;
+    stopTrace();
+    codeValid = false;
+    tracer.reset(new TraceWriter());
+    if (tracer->open(path, memSize, &why)) return true;
+    tracer.reset();
+    char buff[255];
+    snprintf(buff, sizeof(buff), E011, why.c_str());
+    lastError = buff;
+    lastErrorAddr = 0;
+    lastErrorLine = 0;
+    return false;
+}
+
+// Flush and close the trace; false if any of it could not be written.
+bool StackCPU::stopTrace() {
+    if (!tracer) return true;
+    codeValid = false;
+    string why;
+    bool ok = tracer->close(&why);
+    tracer.reset();
+    if (ok) return true;
+    char buff[255];
+    snprintf(buff, sizeof(buff), E011, why.c_str());
+    lastError = buff;
+    lastErrorAddr = 0;
+    lastErrorLine = 0;
+    return false;
 }
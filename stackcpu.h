@@ -23,64 +23,271 @@
 
 #include <string>
 #include <cstring>
+#include <iosfwd>
 #include <vector>
+#include <deque>
+#include <unordered_map>
 #include <cstdio>
 #include <cstdlib>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include "memory.h"
+#include "jit.h"
+#include "profiler.h"
+#include "trace.h"
+#include "tokenizer.h"
+#include "verifier.h"
 
 using namespace std;
 
+#define MAXSTACK 0xff
+
+struct StackView {
+    const int *data;
+    int size;
+
+    const int *begin() const { return data; }
+    const int *end() const { return data + size; }
+};
+
+// Saved CPU state, see StackCPU::snapshot().
+struct Opcode;
+
+class Snapshot {
+private:
+    friend class StackCPU;
+    shared_ptr<const Image> base;
+    vector<int> pages, words;
+    vector<int> ds, rs;
+    int fpc;
+    bool fhalt;
+    long long steps;
+    // why the run stopped, a StackCPU::StopReason, and its details
+    int stop;
+    int watchHit;
+    string lastError;
+    int lastErrorAddr;
+};
+
+// What StackCPU::decode() makes of an image: the decoded op of each of
+// the first size words and the verified blocks. CPUs running the same
+// image with the same settings share one, and a CPU copies it before
+// its first change.
+struct Decoding {
+    struct Insn {
+        int op;
+        int arg;
+    };
+
+    int size;
+    vector<Insn> code;
+    // verified blocks, see verify(); the leader and owner of each
+    // decoded word
+    vector<Block> blocks;
+    vector<int> blockAt, blockOf;
+    // pages of the decoded region holding decoded code
+    vector<bool> codePages;
+};
+
 class StackCPU {
 public:
+    enum Engine {
+        Interpreter,
+        Threaded,
+        // threaded, compiling hot blocks to native code where supported
+        Jit
+    };
+
+    enum StopReason {
+        StopNone,
+        StopHalt,
+        StopError,
+        StopBreakpoint,
+        StopWatchpoint,
+        StopBudget
+    };
+
     StackCPU();
+    explicit StackCPU(shared_ptr<const Image> img);
     ~StackCPU();
     bool compile();
+    bool compile(istream &in);
+    bool compile(int fd);
+    void beginCompile();
+    bool compileChunk(const char *buf, size_t n);
+    bool endCompile();
+    bool saveImage(const string &path);
+    bool loadImage(const string &path);
     void clearStack();
-    bool run();
+    bool run(long long maxInstructions = -1);
+    bool runUntil(chrono::steady_clock::time_point deadline);
     bool stepInto();
     bool stepOver();
+    bool stepBack();
+    bool stepBackTo(long long count);
+    bool runBack();
     void setLines(vector<string> l);
+    void replaceLines(int first, int count, vector<string> with);
     vector<string> *getLines() const;
     string error() const;
+    const vector<Diagnostic> &diagnostics() const;
     int errorAddr() const;
+    int errorLine() const;
     int pc() const;
     bool halt() const;
-    vector<int> dataStack() const;
-    vector<int> returnStack() const;
+    StackView dataStack() const;
+    StackView returnStack() const;
     int getMemSize() const;
     void setMemSize(int val);
+    int getWordBits() const;
+    void setWordBits(int val);
     int memory(int i) const;
+    void setMemory(int i, int val);
+    bool instruction(int addr) const;
+    bool unchecked(int addr) const;
+    shared_ptr<const Image> image() const;
+    shared_ptr<const Image> loadedImage() const;
+    const vector<int> &dirtyPages() const;
+    Snapshot snapshot() const;
+    bool restore(const Snapshot &snap);
+    Engine getEngine() const;
+    void setEngine(Engine val);
+    StopReason stopReason() const;
+    int watchAddr() const;
+    void setBreakpoint(int addr, function<bool(const StackCPU &)> cond = nullptr);
+    void clearBreakpoint(int addr);
+    void clearBreakpoints();
+    bool hasBreakpoint(int addr) const;
+    void addWatchpoint(int lo, int hi);
+    void clearWatchpoints();
+    bool getOptimize() const;
+    void setOptimize(bool val);
+    bool getProtectCode() const;
+    void setProtectCode(bool val);
+    long long instructionCount() const;
+    bool getJournal() const;
+    void setJournal(bool val);
+    bool getProfiling() const;
+    void setProfiling(bool val);
+    const Profile &profile() const;
+    bool startTrace(const string &path);
+    bool stopTrace();
 
 private:
+    typedef Decoding::Insn Insn;
+    struct Assembly;
+    struct Fragment;
+
     vector<string> *lines;
     string lastError;
     int lastErrorAddr;
-    int *mem, *ftmem;
-    vector<int> *ds, *rs;
+    int lastErrorLine;
+    // verifier findings for the image, worked out by diagnostics()
+    mutable vector<Diagnostic> diags;
+    mutable bool diagsValid;
+    // assembler state between beginCompile() and endCompile()
+    unique_ptr<Assembly> assembly;
+    // compile() keeps each line assembled on its own: the fragment of
+    // each of lines, or null where it changed, and fragments by the
+    // operands the line before left pending and by line text. Label
+    // names get ids shared by all fragments.
+    vector<shared_ptr<const Fragment> > frags;
+    unordered_map<string, shared_ptr<const Fragment> > fragCache[2];
+    unordered_map<string, int> labelIds;
+    vector<string> labelNames;
+    int fragBits;
+    Tokenizer lineTok;
+    Memory mem;
+    shared_ptr<const Image> ftimage;
+    int ds[MAXSTACK], rs[MAXSTACK];
+    int dsp, rsp;
     int fpc;
     bool fhalt;
+    StopReason stop;
+    int watchHit;
+    long long steps;
     int memSize;
+    // data width, and 32 less it: values are kept sign-extended
+    int wordBits;
+    int shift;
+    Engine engine;
+    // the decoded image, and the same once this CPU has its own copy
+    shared_ptr<const Decoding> dec;
+    shared_ptr<Decoding> ownDec;
+    int codeSize;
+    bool codeValid;
+    // how many blocks stores have voided
+    int staleBlocks;
+    // per block: native code of the region it leads once hot, entries
+    // counted until then, and the leaders of the regions holding it
+    JitCompiler jit;
+    vector<NativeBlock> natives;
+    vector<int> hits;
+    vector<vector<int> > regions;
+    bool optimize;
+    bool protectCode;
+    bool journaling;
+    deque<int> journal;
+    bool profiling;
+    Profile prof;
+    // per decoded word: instructions a profiled threaded run has counted
+    // there and not yet charged to prof
+    vector<long long> profCounts;
+    unique_ptr<TraceWriter> tracer;
+    unordered_map<int, function<bool(const StackCPU &)> > breakpoints;
+    vector<pair<int, int> > watchpoints;
 
-    int getMem(int addr);
+    int getMem(int addr) const;
     void setMem(int addr, int val);
-    bool push(vector<int> *stack, int val);
-    int pop(vector<int> *stack);
-    int peek(vector<int> *stack);
-    void lineReconstruct();
-    bool preprocessing();
-    bool processing();
+    int load(int v) const;
+    bool readOnly(int addr) const;
+    int opAt(int addr) const;
+    void compileError(const char *fmt, const Token &t, int addr);
+    bool assemble(const Token &t);
+    bool assembleTokens();
+    int labelId(const Token &t);
+    shared_ptr<const Fragment> assembleLine(const string &line, int pending);
+    bool link(size_t n);
     bool step();
+    void record(const Opcode &op, int pc, int dp, int rp);
+    void unrecord();
+    bool breakHit(int addr) const;
+    bool watched(int addr) const;
+    void decode();
+    Decoding &own();
+    void decodeAt(int addr);
+    int baseOp(int addr) const;
+    bool fusable(int addr) const;
+    int fuse(int addr, int c) const;
+    void decodePage(int p);
+    void decodePages(const vector<int> &pages);
+    bool isCode(int addr) const;
+    void redecode(int addr);
+    int runsInto(int addr) const;
+    void invalidate(int addr);
+    template <bool hooked> bool runThreaded(long long end);
+    void chargeCounts();
+    bool tierUp(int block);
+    static int fetch(const void *cpu, int addr);
 };
 
 struct Opcode {
     string ops;
     int opc;
     int pci;
+    // data/return stack effect: entries consumed and produced
+    int dsi, dso;
+    int rsi, rso;
 };
 
+const Opcode *opFind(const char *s, size_t n);
+const Opcode *opFind(int opc);
 int opGetPci(string ops);
 int opGetPci(int opc);
 int opGetOpc(string ops);
 string opGetOps(int opc);
 int opGetCode(int opc);
+bool opStackFits(const Opcode &op, int dsp, int rsp);
 
 #endif // STACKCPU_H
@@ -0,0 +1,840 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+
+// Regression tests for defects found in review. Each test assembles a
+// small program and checks how it runs, on every engine where the
+// engine matters. Prints each failed check and exits 1 if any failed.
+
+#include "stackcpu.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#define TRACEFILE "stackcpu-tests.trace"
+#define IMAGEFILE "stackcpu-tests.img"
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, const char *file, int line) {
+    if (ok) return;
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+    ++failures;
+}
+
+static const StackCPU::Engine engines[] = {
+    StackCPU::Interpreter, StackCPU::Threaded, StackCPU::Jit
+};
+
+static bool load(StackCPU *cpu, const vector<string> &lines) {
+    cpu->setLines(lines);
+    if (!cpu->compile()) return false;
+    cpu->clearStack();
+    return true;
+}
+
+// A jump out of memory stops with "PC out of bounds", and so does every
+// run after it rather than running from the stray PC.
+static void testRunAfterBoundsError() {
+    for (auto&& e : engines) {
+        StackCPU cpu;
+        cpu.setEngine(e);
+        CHECK(load(&cpu, {"LIT 0 IF -3"}));
+        CHECK(!cpu.run());
+        CHECK(cpu.error() == "PC out of bounds");
+        CHECK(cpu.pc() == -3);
+        CHECK(!cpu.run());
+        CHECK(cpu.stopReason() == StackCPU::StopError);
+        CHECK(cpu.error() == "PC out of bounds");
+        CHECK(cpu.pc() == -3);
+    }
+}
+
+// Stepping after such a jump reports the same error without reading
+// outside memory, and stepping back leaves the error behind.
+static void testStepAfterBoundsError() {
+    StackCPU cpu;
+    cpu.setJournal(true);
+    CHECK(load(&cpu, {"LIT 0 IF -3"}));
+    CHECK(cpu.stepInto());
+    CHECK(!cpu.stepInto());
+    CHECK(cpu.pc() == -3);
+    CHECK(!cpu.stepInto());
+    CHECK(!cpu.stepOver());
+    CHECK(cpu.error() == "PC out of bounds");
+    CHECK(cpu.stepBack());
+    CHECK(cpu.pc() == 2);
+    CHECK(cpu.stopReason() == StackCPU::StopNone);
+}
+
+// Assembles lines on a CPU with 8-bit words and 1024 words of memory,
+// either line by line through compile() or as one stream.
+static bool assemble8(StackCPU *cpu, const vector<string> &lines, bool stream) {
+    cpu->setMemSize(1024);
+    cpu->setWordBits(8);
+    if (!stream) return load(cpu, lines);
+    string src;
+    for (auto&& l : lines) src += l + "\n";
+    istringstream in(src);
+    if (!cpu->compile(in)) return false;
+    cpu->clearStack();
+    return true;
+}
+
+// With 8-bit words, label references must fit 8 bits like numbers do,
+// ahead of the label or after it, on both assembler paths.
+static void testLabelRange() {
+    string pad;
+    for (int i = 0; i < 300; ++i) pad += "0 ";
+    for (int stream = 0; stream < 2; ++stream) {
+        StackCPU ahead;
+        CHECK(!assemble8(&ahead, {"LIT :tab @ HALT", pad, ":tab 7"}, stream));
+        CHECK(ahead.error() == "Constant value violates subrange bounds: :TAB");
+        CHECK(ahead.errorAddr() == 1);
+        CHECK(ahead.errorLine() == 1);
+
+        StackCPU after;
+        CHECK(!assemble8(&after, {"LIT 0 IF :main", pad, ":tab 7", ":main LIT :tab @ HALT"}, stream));
+        CHECK(after.error() == "Constant value violates subrange bounds: :TAB");
+        CHECK(after.errorAddr() == 306);
+        CHECK(after.errorLine() == 4);
+
+        for (auto&& e : engines) {
+            StackCPU fits;
+            fits.setEngine(e);
+            CHECK(assemble8(&fits, {"LIT :tab @ HALT", ":tab 7"}, stream));
+            CHECK(fits.run());
+            StackView ds = fits.dataStack();
+            CHECK(ds.size == 1 && ds.data[0] == 7);
+        }
+    }
+}
+
+// With 32-bit words, numbers must fit 32 bits signed or unsigned on
+// both assembler paths rather than being cut to a word.
+static void testLiteralRange() {
+    for (int stream = 0; stream < 2; ++stream) {
+        const char *bad[] = { "LIT 4294967296", "LIT 0x1ffffffff", "LIT -2147483649", "99999999999999999999" };
+        for (auto&& s : bad) {
+            StackCPU cpu;
+            vector<string> lines = {s};
+            bool ok;
+            if (stream) {
+                istringstream in(string(s) + "\n");
+                ok = cpu.compile(in);
+            } else {
+                ok = load(&cpu, lines);
+            }
+            CHECK(!ok);
+            CHECK(cpu.error().find("Constant value violates subrange bounds") == 0);
+        }
+    }
+    StackCPU fits;
+    CHECK(load(&fits, {"LIT 4294967295 LIT -2147483648 HALT"}));
+    CHECK(fits.run());
+    StackView ds = fits.dataStack();
+    CHECK(ds.size == 2 && ds.data[0] == -1 && ds.data[1] == -2147483647 - 1);
+}
+
+// A long run keeps only the newest part of the undo journal, and
+// stepping back through it undoes each instruction in turn.
+static void testJournalBound() {
+    StackCPU cpu;
+    cpu.setEngine(StackCPU::Interpreter);
+    cpu.setJournal(true);
+    CHECK(load(&cpu, {":top LIT 5 >R R> DROP LIT 0 IF :top"}));
+    const long long run = 5000000;
+    CHECK(cpu.run(run));
+    long long back = 0;
+    while (cpu.stepBack()) ++back;
+    CHECK(back > 0 && back < run);
+    CHECK(cpu.instructionCount() == run - back);
+    // the loop is 6 instructions long
+    int pc = cpu.pc();
+    CHECK(cpu.run(6));
+    CHECK(cpu.pc() == pc);
+}
+
+// The state after each instruction, as stepping back passes it.
+static string journalState(const StackCPU &cpu) {
+    ostringstream o;
+    o << cpu.pc() << " " << cpu.instructionCount() << " |";
+    for (int v : cpu.dataStack()) o << " " << v;
+    o << " |";
+    for (int v : cpu.returnStack()) o << " " << v;
+    o << " | " << cpu.memory(cpu.getMemSize() - 1);
+    return o.str();
+}
+
+// A journaled run records the same journal on every engine, through
+// budget and breakpoint stops, stores, calls and a run that fails, so
+// stepping back passes the same states.
+static void testJournalEngines() {
+    vector<string> prog = {
+        "LIT 3 :loop DUP LIT 255 ! CALL :sub LIT 1 - DUP IF :done LIT 0 IF :loop",
+        ":done DROP DROP HALT :sub LIT 255 @ >R R> DROP EXIT"
+    };
+    vector<string> ref;
+    for (auto&& e : engines) {
+        StackCPU cpu;
+        cpu.setEngine(e);
+        cpu.setJournal(true);
+        cpu.setMemSize(256);
+        CHECK(load(&cpu, prog));
+        CHECK(cpu.run(9));
+        CHECK(cpu.stopReason() == StackCPU::StopBudget);
+        cpu.setBreakpoint(2);
+        int hits = 0;
+        while (cpu.run() && cpu.stopReason() == StackCPU::StopBreakpoint) ++hits;
+        CHECK(hits == 2);
+        CHECK(cpu.stopReason() == StackCPU::StopError);
+        CHECK(cpu.error() == "Stack overflow/underflow");
+        vector<string> states(1, journalState(cpu));
+        while (cpu.stepBack()) states.push_back(journalState(cpu));
+        CHECK(cpu.instructionCount() == 0);
+        if (e == engines[0]) ref = states;
+        else CHECK(states == ref);
+    }
+    CHECK(ref.size() > 30);
+}
+
+// A store into a watched range stops the run just after it, on every
+// engine, and the run carries on from there.
+static void testWatchpoints() {
+    for (auto&& e : engines) {
+        StackCPU cpu;
+        cpu.setEngine(e);
+        cpu.setMemSize(256);
+        CHECK(load(&cpu, {"LIT 1 LIT 100 ! LIT 2 LIT 200 ! HALT"}));
+        cpu.addWatchpoint(150, 250);
+        CHECK(cpu.run());
+        CHECK(cpu.stopReason() == StackCPU::StopWatchpoint);
+        CHECK(cpu.watchAddr() == 200 && cpu.pc() == 10);
+        CHECK(cpu.memory(100) == 1 && cpu.memory(200) == 2);
+        CHECK(cpu.run());
+        CHECK(cpu.stopReason() == StackCPU::StopHalt);
+        cpu.clearWatchpoints();
+        cpu.clearStack();
+        CHECK(cpu.run());
+        CHECK(cpu.stopReason() == StackCPU::StopHalt);
+    }
+}
+
+// A conditional breakpoint stops only where its condition holds, on
+// every engine, and resuming from it runs on.
+static void testConditionalBreakpoint() {
+    for (auto&& e : engines) {
+        StackCPU cpu;
+        cpu.setEngine(e);
+        CHECK(load(&cpu, {"LIT 5 :loop LIT 1 - DUP IF :done LIT 0 IF :loop :done HALT"}));
+        int asked = 0;
+        cpu.setBreakpoint(2, [&asked](const StackCPU &c) {
+            ++asked;
+            StackView ds = c.dataStack();
+            return ds.size == 1 && ds.data[0] == 2;
+        });
+        CHECK(cpu.run());
+        CHECK(cpu.stopReason() == StackCPU::StopBreakpoint && cpu.pc() == 2);
+        CHECK(cpu.dataStack().data[0] == 2);
+        CHECK(cpu.run());
+        CHECK(cpu.stopReason() == StackCPU::StopHalt);
+        CHECK(cpu.dataStack().size == 1 && cpu.dataStack().data[0] == 0);
+        // at 5, 4, 3, 2 and 1, but not again on resuming at 2
+        CHECK(asked == 5);
+    }
+}
+
+// Restoring a snapshot brings back why the run had stopped, not the
+// error of the run since.
+static void testRestoreStop() {
+    StackCPU cpu;
+    CHECK(load(&cpu, {"LIT 1 LIT 0 IF 0 DROP DROP HALT"}));
+    CHECK(cpu.run(1));
+    Snapshot snap = cpu.snapshot();
+    CHECK(!cpu.run());
+    CHECK(cpu.error() == "Stack overflow/underflow");
+    CHECK(cpu.restore(snap));
+    CHECK(cpu.stopReason() == StackCPU::StopBudget);
+    CHECK(cpu.error() == "");
+    CHECK(cpu.pc() == 2);
+}
+
+// A snapshot only restores onto the image it was taken from, even once
+// a recompile has freed that image and another may sit at its address.
+static void testRestoreOtherImage() {
+    StackCPU cpu;
+    cpu.setMemSize(32);
+    CHECK(load(&cpu, {"LIT 5 LIT 3 ! HALT"}));
+    CHECK(cpu.run());
+    Snapshot snap = cpu.snapshot();
+    cpu.setMemSize(1024);
+    for (int i = 0; i < 8; ++i) {
+        CHECK(load(&cpu, {"LIT 5 LIT 3 ! HALT"}));
+        CHECK(!cpu.restore(snap));
+        CHECK(cpu.memory(40) == 0);
+    }
+}
+
+// Every word that differs from the loaded image lies on a dirty page,
+// which is what lets the memory view compare only those pages.
+static bool dirtyCovers(const StackCPU &cpu) {
+    shared_ptr<const Image> img = cpu.loadedImage();
+    vector<bool> dirty(cpu.getMemSize() / PAGESIZE + 1);
+    for (auto&& p : cpu.dirtyPages()) dirty[p] = true;
+    for (int a = 0; a < cpu.getMemSize(); ++a) {
+        int w = a < img->extent() ? img->data()[a] : 0;
+        if (cpu.memory(a) != w && !dirty[a >> PAGESHIFT]) return false;
+    }
+    return true;
+}
+
+static void testDirtyPages() {
+    for (auto&& e : engines) {
+        StackCPU cpu;
+        cpu.setEngine(e);
+        cpu.setMemSize(1024);
+        CHECK(load(&cpu, {"LIT 9 LIT 600 ! LIT 8 LIT 70 ! HALT"}));
+        CHECK(cpu.dirtyPages().empty());
+        Snapshot snap = cpu.snapshot();
+        CHECK(cpu.run());
+        CHECK(cpu.memory(600) == 9 && cpu.memory(70) == 8);
+        CHECK(cpu.dirtyPages().size() == 2);
+        CHECK(dirtyCovers(cpu));
+        CHECK(cpu.restore(snap));
+        CHECK(cpu.dirtyPages().empty());
+        CHECK(cpu.memory(600) == 0);
+        CHECK(dirtyCovers(cpu));
+    }
+}
+
+// A profile comes out the same whichever engine ran the program,
+// through calls, R> leaving a subroutine and stores.
+static void testProfileEngines() {
+    vector<string> prog = {
+        "LIT 3 :loop CALL :sub LIT 1 - DUP IF :done LIT 0 IF :loop",
+        ":done DROP CALL :pop :pop R> DROP HALT",
+        ":sub LIT :var @ LIT 1 + LIT :var ! LIT 0 IF :tail :tail EXIT :var 0"
+    };
+    string report, folded;
+    for (auto&& e : engines) {
+        StackCPU cpu;
+        cpu.setEngine(e);
+        cpu.setProfiling(true);
+        cpu.setMemSize(256);
+        CHECK(load(&cpu, prog));
+        CHECK(cpu.run());
+        CHECK(cpu.getEngine() == e);
+        if (e == engines[0]) {
+            report = cpu.profile().report(vector<Symbol>());
+            folded = cpu.profile().folded(vector<Symbol>());
+            CHECK(cpu.profile().routines().size() == 2);
+        } else {
+            CHECK(cpu.profile().report(vector<Symbol>()) == report);
+            CHECK(cpu.profile().folded(vector<Symbol>()) == folded);
+        }
+    }
+}
+
+// A trace comes out byte for byte the same whichever engine ran the
+// program, including a run stopped by its budget and resumed.
+static void testTraceEngines() {
+    vector<string> prog = {
+        "LIT 4 :loop DUP LIT :var ! CALL :sub LIT 1 - DUP IF :done LIT 0 IF :loop",
+        ":done HALT :sub LIT :var @ DROP EXIT :var 0"
+    };
+    string ref;
+    for (auto&& e : engines) {
+        StackCPU cpu;
+        cpu.setEngine(e);
+        cpu.setMemSize(256);
+        CHECK(load(&cpu, prog));
+        CHECK(cpu.startTrace(TRACEFILE));
+        cpu.clearStack();
+        CHECK(cpu.run(7));
+        CHECK(cpu.run());
+        CHECK(cpu.stopTrace());
+        ifstream in(TRACEFILE, ios::binary);
+        string s((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        if (e == engines[0]) ref = s;
+        else CHECK(s == ref);
+    }
+    remove(TRACEFILE);
+    CHECK(!ref.empty());
+}
+
+static string readFile(const char *path) {
+    ifstream in(path, ios::binary);
+    return string((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+}
+
+static void writeFile(const char *path, const string &s) {
+    ofstream out(path, ios::binary);
+    out << s;
+}
+
+// A saved image loads back with the same memory, opcode tags, word
+// width, size and symbols, and runs the same.
+static void testImageRoundTrip() {
+    StackCPU src;
+    src.setMemSize(1024);
+    src.setWordBits(16);
+    CHECK(load(&src, {"LIT :tab @ LIT :tab LIT 1 + @ + HALT", ":tab 7 -5"}));
+    CHECK(src.saveImage(IMAGEFILE));
+    StackCPU cpu;
+    CHECK(cpu.loadImage(IMAGEFILE));
+    cpu.clearStack();
+    CHECK(cpu.getMemSize() == 1024 && cpu.getWordBits() == 16);
+    bool same = true;
+    for (int a = 0; a < 1024; ++a) {
+        if (cpu.memory(a) != src.memory(a) || cpu.instruction(a) != src.instruction(a)) same = false;
+    }
+    CHECK(same);
+    const vector<Symbol> &syms = cpu.image()->symbols();
+    CHECK(syms.size() == 1 && syms[0].name == src.image()->symbols()[0].name
+          && syms[0].addr == src.image()->symbols()[0].addr);
+    CHECK(cpu.run());
+    StackView ds = cpu.dataStack();
+    CHECK(ds.size == 1 && ds.data[0] == 2);
+    remove(IMAGEFILE);
+}
+
+// Damaged image files are rejected with the reason, through the mapped
+// path, and leave the loaded program alone.
+static void testImageRejects() {
+    StackCPU src;
+    CHECK(load(&src, {"LIT 5 HALT"}));
+    CHECK(src.saveImage(IMAGEFILE));
+    string good = readFile(IMAGEFILE);
+    CHECK(good.size() > 32);
+    struct {
+        string bytes;
+        const char *why;
+    } cases[] = {
+        { "XCPU" + good.substr(4), "not an image file" },
+        { good.substr(0, 4) + string("\x63\0\0\0", 4) + good.substr(8), "unsupported version" },
+        { good.substr(0, good.size() - 1) + static_cast<char>(good.back() ^ 1), "checksum mismatch" },
+        { good.substr(0, good.size() - 4), "corrupt header" },
+        { good.substr(0, 16), "file too short" }
+    };
+    for (auto&& c : cases) {
+        writeFile(IMAGEFILE, c.bytes);
+        StackCPU cpu;
+        CHECK(load(&cpu, {"LIT 9 HALT"}));
+        CHECK(!cpu.loadImage(IMAGEFILE));
+        CHECK(cpu.error() == string("Cannot load image: ") + c.why);
+        CHECK(cpu.run());
+        CHECK(cpu.dataStack().size == 1 && cpu.dataStack().data[0] == 9);
+    }
+    remove(IMAGEFILE);
+}
+
+// Replaying a record whose PC is off the end of memory reports a
+// mismatch rather than reading there, and a trace that cannot be
+// written reports why.
+static void testTraceBounds() {
+    StackCPU cpu;
+    CHECK(load(&cpu, {"LIT 0 IF -3"}));
+    CHECK(!cpu.run());
+    TraceWriter w;
+    string why;
+    CHECK(w.open(TRACEFILE, cpu.getMemSize(), &why));
+    w.put(-3, 0, 0);
+    CHECK(w.close(&why));
+    TraceReader r;
+    CHECK(r.open(TRACEFILE, &why));
+    CHECK(!r.replay(&cpu, 1, &why));
+    CHECK(why == "pc differs at record 0, address -3");
+    remove(TRACEFILE);
+#ifdef __linux__
+    TraceWriter full;
+    CHECK(full.open("/dev/full", 32, &why));
+    for (int i = 0; i < 100000; ++i) full.put(i, 0, i);
+    errno = EBADF;
+    CHECK(!full.close(&why));
+    CHECK(why == strerror(ENOSPC));
+#endif
+}
+
+// A loop of short blocks comes out the same on every engine when its
+// budget runs out within the loop and when a word of its body changes
+// after the Jit engine has compiled it.
+static void testJitLoop() {
+    vector<string> prog = {
+        "LIT 0 LIT 300 :loop SWAP LIT 2 + SWAP LIT 1 - DUP IF :done LIT 0 IF :loop",
+        ":done DROP HALT"
+    };
+    int sum = 0;
+    long long count = 0;
+    for (auto&& e : engines) {
+        StackCPU cpu;
+        cpu.setEngine(e);
+        cpu.setMemSize(256);
+        CHECK(load(&cpu, prog));
+        CHECK(cpu.run(1001));
+        CHECK(cpu.instructionCount() == 1001);
+        cpu.setMemory(6, 5);
+        CHECK(cpu.run());
+        StackView ds = cpu.dataStack();
+        CHECK(ds.size == 1);
+        if (e == engines[0]) {
+            sum = ds.data[0];
+            count = cpu.instructionCount();
+        } else {
+            CHECK(ds.data[0] == sum);
+            CHECK(cpu.instructionCount() == count);
+        }
+    }
+    CHECK(sum > 600);
+}
+
+// diagnostics() reports the first instruction of a block that must
+// underflow, where running the program fails too; a program without
+// findings runs its straight-line code unchecked on the engines that
+// decode it.
+static void testDiagnostics() {
+    vector<vector<string> > bad = {
+        {"LIT 1 LIT 2 + + HALT"},
+        {"LIT 0 IF :x", ":x DROP HALT"},
+        {"LIT 1 >R R> R> HALT"}
+    };
+    int addrs[] = { 5, 4, 4 };
+    const char *messages[] = { "Data stack underflow", "Data stack underflow", "Return stack underflow" };
+    for (size_t i = 0; i < bad.size(); ++i) {
+        for (auto&& e : engines) {
+            StackCPU cpu;
+            cpu.setEngine(e);
+            CHECK(load(&cpu, bad[i]));
+            const vector<Diagnostic> &diags = cpu.diagnostics();
+            CHECK(diags.size() == 1);
+            if (diags.size() != 1) continue;
+            CHECK(diags[0].addr == addrs[i]);
+            CHECK(diags[0].message == messages[i]);
+            CHECK(!cpu.run());
+            CHECK(cpu.errorAddr() == addrs[i]);
+        }
+    }
+
+    for (auto&& e : engines) {
+        StackCPU cpu;
+        cpu.setEngine(e);
+        CHECK(load(&cpu, {"LIT 1 LIT 2 + LIT 3 + LIT 4 + DUP DROP HALT"}));
+        CHECK(cpu.diagnostics().empty());
+        CHECK(cpu.run());
+        CHECK(cpu.unchecked(0) == (e != StackCPU::Interpreter));
+        StackView ds = cpu.dataStack();
+        CHECK(ds.size == 1 && ds.data[0] == 10);
+    }
+}
+
+// Compiling after replaceLines gives the same memory, tags and errors
+// as compiling the edited source from scratch, also where the edit
+// moves, renames or redefines a label used on other lines.
+static void testReplaceLines() {
+    struct Edit {
+        int first, count;
+        vector<string> with;
+    };
+    vector<Edit> edits = {
+        {1, 1, {":loop SWAP LIT 4 + SWAP"}},
+        {0, 1, {"LIT 0 LIT 6 DUP DROP"}},
+        {1, 1, {":again SWAP LIT 4 + SWAP"}},
+        {3, 1, {"LIT 0 IF :again"}},
+        {2, 1, {"LIT", "1 - DUP IF :done"}},
+        {5, 2, {":done DROP LIT :tab @ +", "HALT", ":tab 9"}},
+        {0, 0, {":tab 3", "HALT"}},
+        {0, 2, {}}
+    };
+    StackCPU cpu;
+    CHECK(load(&cpu, {
+        "LIT 0 LIT 5",
+        ":loop SWAP LIT 3 + SWAP",
+        "LIT 1 - DUP IF :done",
+        "LIT 0 IF :loop",
+        ":done DROP LIT :tab @ + HALT",
+        ":tab 7"
+    }));
+    for (auto&& ed : edits) {
+        cpu.replaceLines(ed.first, ed.count, ed.with);
+        StackCPU full;
+        full.setLines(*cpu.getLines());
+        bool ok = full.compile();
+        CHECK(cpu.compile() == ok);
+        if (!ok) {
+            CHECK(cpu.error() == full.error());
+            CHECK(cpu.errorAddr() == full.errorAddr());
+            CHECK(cpu.errorLine() == full.errorLine());
+            continue;
+        }
+        cpu.clearStack();
+        full.clearStack();
+        int same = 0;
+        for (int i = 0; i < full.getMemSize(); ++i) {
+            same += cpu.memory(i) == full.memory(i) && cpu.instruction(i) == full.instruction(i);
+        }
+        CHECK(same == full.getMemSize());
+        CHECK(cpu.run() && full.run());
+        StackView a = cpu.dataStack(), b = full.dataStack();
+        CHECK(a.size == 1 && b.size == 1 && a.data[0] == b.data[0]);
+    }
+}
+
+// Source fed to compileChunk one byte at a time, splitting every word
+// and comment, assembles as it does in one piece, errors included.
+static void testCompileChunks() {
+    const char *sources[] = {
+        "; sums\nLIT 0 LIT 300 ; count\n"
+        ":loop SWAP LIT 2 + SWAP LIT 1 - DUP IF :done LIT 0 IF :loop\n"
+        ":done DROP HALT ; end\n",
+        "LIT :tab @\tHALT\r\n:tab 0x1f ; data\r\n",
+        "HALT ; no newline",
+        "LIT 1 ; fine\nLIT 2 BOGUS + HALT\n",
+        "LIT 0 IF :nowhere\nHALT",
+        "LIT 4294967296 HALT",
+        ":twice HALT\n:twice"
+    };
+    for (auto&& s : sources) {
+        string src = s;
+        StackCPU whole, bytes;
+        whole.beginCompile();
+        whole.compileChunk(src.data(), src.size());
+        bool ok = whole.endCompile();
+        bytes.beginCompile();
+        for (size_t i = 0; i < src.size(); ++i) bytes.compileChunk(&src[i], 1);
+        CHECK(bytes.endCompile() == ok);
+        if (!ok) {
+            CHECK(bytes.error() == whole.error());
+            CHECK(bytes.errorAddr() == whole.errorAddr());
+            CHECK(bytes.errorLine() == whole.errorLine());
+            continue;
+        }
+        whole.clearStack();
+        bytes.clearStack();
+        int same = 0;
+        for (int i = 0; i < whole.getMemSize(); ++i) {
+            same += bytes.memory(i) == whole.memory(i) && bytes.instruction(i) == whole.instruction(i);
+        }
+        CHECK(same == whole.getMemSize());
+        CHECK(whole.run() == bytes.run());
+        CHECK(whole.error() == bytes.error());
+        StackView a = whole.dataStack(), b = bytes.dataStack();
+        CHECK(a.size == b.size && equal(a.data, a.data + a.size, b.data));
+    }
+}
+
+// runUntil runs nothing once its deadline has passed, and a long loop
+// resumed slice by slice counts the same instructions as one run.
+static void testRunUntil() {
+    vector<string> prog = {
+        "LIT 3000000 :loop LIT 1 - DUP IF :done LIT 0 IF :loop",
+        ":done DROP HALT"
+    };
+    long long count = 0;
+    for (auto&& e : engines) {
+        StackCPU cpu;
+        cpu.setEngine(e);
+        cpu.setMemSize(256);
+        CHECK(load(&cpu, prog));
+        CHECK(cpu.runUntil(chrono::steady_clock::now() - chrono::seconds(1)));
+        CHECK(cpu.stopReason() == StackCPU::StopBudget);
+        CHECK(cpu.instructionCount() == 0);
+        int slices = 0;
+        long long last = 0;
+        for (;;) {
+            CHECK(cpu.runUntil(chrono::steady_clock::now() + chrono::milliseconds(1)));
+            if (cpu.stopReason() != StackCPU::StopBudget) break;
+            CHECK(cpu.instructionCount() > last);
+            CHECK(cpu.instructionCount() % 0x10000 == 0);
+            last = cpu.instructionCount();
+            ++slices;
+        }
+        CHECK(cpu.stopReason() == StackCPU::StopHalt);
+        CHECK(slices > 1);
+        CHECK(cpu.runUntil(chrono::steady_clock::now() - chrono::seconds(1)));
+        CHECK(cpu.stopReason() == StackCPU::StopHalt);
+        if (e == engines[0]) count = cpu.instructionCount();
+        else CHECK(cpu.instructionCount() == count);
+    }
+    CHECK(count > 18000000);
+}
+
+// Tasks submitted from several threads at once each run exactly once
+// and wait() returns when all are done, also for parallelFor.
+static void testThreadPool() {
+    const int submitters = 4, tasks = 2000;
+    ThreadPool pool(4);
+    unique_ptr<atomic<int>[]> runs(new atomic<int>[submitters * tasks]);
+    for (int i = 0; i < submitters * tasks; ++i) runs[i] = 0;
+    vector<thread> threads;
+    for (int s = 0; s < submitters; ++s) {
+        threads.push_back(thread([&, s]() {
+            for (int i = 0; i < tasks; ++i) {
+                atomic<int> *r = &runs[s * tasks + i];
+                pool.submit([r]() { ++*r; });
+            }
+        }));
+    }
+    for (auto&& t : threads) t.join();
+    pool.wait();
+    int once = 0;
+    for (int i = 0; i < submitters * tasks; ++i) once += runs[i] == 1;
+    CHECK(once == submitters * tasks);
+
+    pool.parallelFor(submitters * tasks, [&](int i) { ++runs[i]; });
+    once = 0;
+    for (int i = 0; i < submitters * tasks; ++i) once += runs[i] == 2;
+    CHECK(once == submitters * tasks);
+}
+
+// A program may store into its own code on every engine unless code
+// is protected, when the store stops with an error.
+static void testStoreIntoCode() {
+    vector<string> prog = {"LIT 7 LIT :x LIT 1 + ! :x LIT 0 HALT"};
+    for (auto&& e : engines) {
+        StackCPU cpu;
+        cpu.setEngine(e);
+        CHECK(load(&cpu, prog));
+        CHECK(cpu.run());
+        StackView ds = cpu.dataStack();
+        CHECK(ds.size == 1 && ds.data[0] == 7);
+        CHECK(load(&cpu, {"LIT 42 LIT 1 ! HALT"}));
+        CHECK(cpu.run());
+        CHECK(cpu.memory(1) == 42);
+        cpu.setProtectCode(true);
+        CHECK(load(&cpu, prog));
+        CHECK(!cpu.run());
+        CHECK(cpu.error() == "Cannot store into code");
+    }
+}
+
+// An opcode stored over data in a page holding code runs, on every
+// engine and after a snapshot of the store is restored, unless code is
+// protected, when the word stays data. Stepping back over the store
+// makes it data again.
+static void testStoreNewCode() {
+    vector<string> prog = {"LIT 7 LIT :h @ LIT :x ! LIT 0 IF :x :h HALT :x 0"};
+    for (auto&& e : engines) {
+        StackCPU cpu;
+        cpu.setEngine(e);
+        CHECK(load(&cpu, prog));
+        CHECK(!cpu.instruction(13));
+        CHECK(cpu.run(5));
+        CHECK(cpu.instruction(13));
+        Snapshot snap = cpu.snapshot();
+        CHECK(cpu.run());
+        CHECK(cpu.halt() && cpu.pc() == 13);
+        StackView ds = cpu.dataStack();
+        CHECK(ds.size == 1 && ds.data[0] == 7);
+        cpu.clearStack();
+        CHECK(!cpu.instruction(13));
+        CHECK(cpu.restore(snap));
+        CHECK(cpu.instruction(13));
+        CHECK(cpu.run());
+        CHECK(cpu.halt() && cpu.pc() == 13);
+        cpu.setProtectCode(true);
+        CHECK(load(&cpu, prog));
+        CHECK(!cpu.run());
+        CHECK(cpu.errorAddr() == 13 && !cpu.instruction(13));
+        cpu.setProtectCode(false);
+        cpu.setJournal(true);
+        CHECK(load(&cpu, prog));
+        CHECK(cpu.run(5));
+        CHECK(cpu.instruction(13));
+        CHECK(cpu.stepBack());
+        CHECK(!cpu.instruction(13) && cpu.memory(13) == 0);
+        CHECK(cpu.run());
+        CHECK(cpu.halt() && cpu.pc() == 13);
+    }
+}
+
+// CPUs started from one image share its decoding, and what one writes
+// into its code or patches in for a breakpoint stays its own.
+static void testSharedDecoding() {
+    StackCPU src;
+    CHECK(load(&src, {"LIT 5 LIT 1 + HALT"}));
+    shared_ptr<const Image> img = src.image();
+    for (auto&& e : engines) {
+        StackCPU a(img);
+        a.setEngine(e);
+        CHECK(a.run());
+        CHECK(a.dataStack().size == 1 && a.dataStack().data[0] == 6);
+        a.clearStack();
+        a.setMemory(1, 9);
+        CHECK(a.run());
+        CHECK(a.dataStack().data[0] == 10);
+        StackCPU b(img);
+        b.setEngine(e);
+        CHECK(b.run());
+        CHECK(b.dataStack().data[0] == 6);
+        StackCPU c(img);
+        c.setEngine(e);
+        c.setMemory(1, 8);
+        CHECK(c.run());
+        CHECK(c.dataStack().data[0] == 9);
+        StackCPU d(img);
+        d.setEngine(e);
+        d.setBreakpoint(2);
+        CHECK(d.run());
+        CHECK(d.stopReason() == StackCPU::StopBreakpoint && d.pc() == 2);
+        StackCPU f(img);
+        f.setEngine(e);
+        CHECK(f.run());
+        CHECK(f.dataStack().data[0] == 6 && f.stopReason() == StackCPU::StopHalt);
+    }
+}
+
+int main() {
+    testRunAfterBoundsError();
+    testStepAfterBoundsError();
+    testLabelRange();
+    testLiteralRange();
+    testJournalBound();
+    testJournalEngines();
+    testWatchpoints();
+    testConditionalBreakpoint();
+    testRestoreStop();
+    testRestoreOtherImage();
+    testDirtyPages();
+    testProfileEngines();
+    testTraceEngines();
+    testTraceBounds();
+    testImageRoundTrip();
+    testImageRejects();
+    testJitLoop();
+    testDiagnostics();
+    testReplaceLines();
+    testCompileChunks();
+    testRunUntil();
+    testStoreIntoCode();
+    testStoreNewCode();
+    testSharedDecoding();
+    testThreadPool();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,161 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#include "threadpool.h"
+
+// index of the pool worker running on this thread, -1 elsewhere
+static thread_local int workerId = -1;
+static thread_local const ThreadPool *workerPool = NULL;
+
+ThreadPool::ThreadPool(int threads) : pending(0), next(0), stop(false), helpers(0) {
+    if (threads <= 0) threads = thread::hardware_concurrency();
+    if (threads <= 0) threads = 1;
+    for (int i = 0; i < threads; ++i) {
+        queues.push_back(unique_ptr<Queue>(new Queue()));
+    }
+    for (int i = 0; i < threads; ++i) {
+        this->threads.push_back(thread(&ThreadPool::loop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    wait();
+    {
+        lock_guard<mutex> lock(m);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto&& t : threads) t.join();
+}
+
+int ThreadPool::size() const {
+    return static_cast<int>(queues.size());
+}
+
+// Tasks submitted from a worker go to its own queue; others are spread
+// round-robin.
+void ThreadPool::submit(function<void()> task) {
+    int id = workerPool == this ? workerId : next++ % queues.size();
+    ++pending;
+    {
+        lock_guard<mutex> lock(queues[id]->m);
+        queues[id]->tasks.push_back(move(task));
+    }
+    lock_guard<mutex> lock(m);
+    wake.notify_one();
+    if (helpers) idle.notify_all();
+}
+
+// Run f(0) .. f(n - 1) and wait for all of them. Indices are handed out
+// in chunks small enough for stealing to even out uneven work.
+void ThreadPool::parallelFor(int n, const function<void(int)> &f) {
+    int chunk = n / (size() * 8);
+    if (chunk < 1) chunk = 1;
+    for (int i = 0; i < n; i += chunk) {
+        int e = i + chunk < n ? i + chunk : n;
+        submit([&f, i, e]() {
+            for (int j = i; j < e; ++j) f(j);
+        });
+    }
+    wait();
+}
+
+// Wait for every task submitted. A task waiting on a worker helps out
+// instead of blocking its own queue, sleeping while there is nothing to
+// take, and is done once the tasks left are all waiting too.
+void ThreadPool::wait() {
+    function<void()> task;
+    if (workerPool == this) {
+        ++helpers;
+        while (pending > helpers) {
+            if (take(workerId, &task)) {
+                task();
+                task = nullptr;
+                finish();
+                continue;
+            }
+            unique_lock<mutex> lock(m);
+            idle.wait(lock, [this]() { return pending <= helpers || queued(); });
+        }
+        --helpers;
+        return;
+    }
+    unique_lock<mutex> lock(m);
+    idle.wait(lock, [this]() { return pending == 0; });
+}
+
+// Whether any queue holds a task; called with m held, so that a
+// submit() after it wakes the caller once it waits.
+bool ThreadPool::queued() {
+    for (auto&& q : queues) {
+        lock_guard<mutex> ql(q->m);
+        if (!q->tasks.empty()) return true;
+    }
+    return false;
+}
+
+// Count a task done, waking wait() if it may be over.
+void ThreadPool::finish() {
+    if (--pending == 0 || helpers > 0) {
+        lock_guard<mutex> lock(m);
+        idle.notify_all();
+    }
+}
+
+bool ThreadPool::take(int id, function<void()> *task) {
+    {
+        Queue &q = *queues[id];
+        lock_guard<mutex> lock(q.m);
+        if (!q.tasks.empty()) {
+            *task = move(q.tasks.back());
+            q.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); ++i) {
+        Queue &q = *queues[(id + i) % queues.size()];
+        lock_guard<mutex> lock(q.m);
+        if (!q.tasks.empty()) {
+            *task = move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::loop(int id) {
+    workerId = id;
+    workerPool = this;
+    function<void()> task;
+    for (;;) {
+        if (take(id, &task)) {
+            task();
+            task = nullptr;
+            finish();
+            continue;
+        }
+        unique_lock<mutex> lock(m);
+        if (stop) return;
+        // re-check under the lock so a concurrent submit is not missed
+        if (!queued()) wake.wait(lock);
+    }
+}
@@ -0,0 +1,70 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Work-stealing pool: every worker owns a deque, runs its own tasks
+// newest first and steals the oldest task of another worker when it
+// runs dry.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads = 0);
+    ~ThreadPool();
+    void submit(function<void()> task);
+    void parallelFor(int n, const function<void(int)> &f);
+    void wait();
+    int size() const;
+
+private:
+    struct Queue {
+        mutex m;
+        deque<function<void()> > tasks;
+    };
+
+    vector<unique_ptr<Queue> > queues;
+    vector<thread> threads;
+    mutex m;
+    condition_variable wake, idle;
+    atomic<int> pending;
+    atomic<unsigned> next;
+    bool stop;
+    // calls to wait() made by tasks and not yet returned
+    atomic<int> helpers;
+
+    bool take(int id, function<void()> *task);
+    bool queued();
+    void finish();
+    void loop(int id);
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,151 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#include "tokenizer.h"
+#include <cctype>
+#include <cstring>
+
+#define BLOCKSIZE 0x10000
+
+size_t TokenHash::operator()(const Token &t) const {
+    size_t h = 2166136261u;
+    for (int i = 0; i < t.len; ++i) {
+        h = (h ^ static_cast<unsigned char>(t.s[i])) * 16777619u;
+    }
+    return h;
+}
+
+bool TokenEqual::operator()(const Token &a, const Token &b) const {
+    return a.len == b.len && memcmp(a.s, b.s, a.len) == 0;
+}
+
+Tokenizer::Tokenizer() {
+    cur = end = tok = NULL;
+    comment = false;
+    line = 1;
+    col = 1;
+    tokLine = tokCol = 0;
+}
+
+Tokenizer::~Tokenizer() {
+    clear();
+}
+
+void Tokenizer::clear() {
+    for (auto&& b : blocks) delete[] b;
+    blocks.clear();
+    toks.clear();
+    cur = end = tok = NULL;
+    comment = false;
+    line = 1;
+    col = 1;
+}
+
+// Forget the tokens returned so far and reuse their arena, so a long
+// source scanned in chunks needs no more than a block at a time. The
+// token being built stays, and line numbers carry on.
+void Tokenizer::drop() {
+    toks.clear();
+    if (blocks.size() > 1) {
+        for (size_t i = 0; i + 1 < blocks.size(); ++i) delete[] blocks[i];
+        blocks.erase(blocks.begin(), blocks.end() - 1);
+    }
+    if (blocks.empty()) return;
+    // grow() keeps the token being built in the last block
+    size_t part = tok ? cur - tok : 0;
+    if (part) memmove(blocks[0], tok, part);
+    tok = tok ? blocks[0] : NULL;
+    cur = blocks[0] + part;
+}
+
+const vector<Token> &Tokenizer::tokens() const {
+    return toks;
+}
+
+// start a new arena block, carrying over the token being built so
+// that every token stays contiguous
+void Tokenizer::grow(size_t n) {
+    size_t part = tok ? cur - tok : 0;
+    size_t size = BLOCKSIZE;
+    while (size < part + n) size *= 2;
+    char *b = new char[size];
+    if (part) memcpy(b, tok, part);
+    blocks.push_back(b);
+    tok = tok ? b : NULL;
+    cur = b + part;
+    end = b + size;
+}
+
+void Tokenizer::put(char c) {
+    if (cur == end) grow(2);
+    *cur++ = c;
+}
+
+void Tokenizer::endToken() {
+    if (!tok) return;
+    put('\0');
+    Token t;
+    t.s = tok;
+    t.len = static_cast<int>(cur - tok - 1);
+    t.line = tokLine;
+    t.col = tokCol;
+    toks.push_back(t);
+    tok = NULL;
+}
+
+// Split buf into whitespace separated words, dropping ';' comments.
+// May be called repeatedly; tokens and comments carry over between
+// calls until finish().
+void Tokenizer::scan(const char *buf, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        char c = buf[i];
+        if (c == '\n') {
+            endToken();
+            comment = false;
+            ++line;
+            col = 1;
+            continue;
+        }
+        ++col;
+        if (comment) continue;
+        if (c == ' ' || c == '\t' || c == '\r') {
+            endToken();
+            continue;
+        }
+        if (c == ';') {
+            endToken();
+            comment = true;
+            continue;
+        }
+        if (!tok) {
+            if (cur == end) grow(2);
+            tok = cur;
+            tokLine = line;
+            tokCol = col - 1;
+        }
+        put(static_cast<char>(toupper(static_cast<unsigned char>(c))));
+    }
+}
+
+void Tokenizer::finish() {
+    endToken();
+    comment = false;
+}
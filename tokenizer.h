@@ -0,0 +1,71 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+// A token is a view into the tokenizer arena: the uppercased text,
+// NUL-terminated, plus where it started in the source.
+struct Token {
+    const char *s;
+    int len;
+    int line;
+    int col;
+};
+
+struct TokenHash {
+    size_t operator()(const Token &t) const;
+};
+
+struct TokenEqual {
+    bool operator()(const Token &a, const Token &b) const;
+};
+
+class Tokenizer {
+public:
+    Tokenizer();
+    ~Tokenizer();
+    void scan(const char *buf, size_t n);
+    void finish();
+    void drop();
+    void clear();
+    const vector<Token> &tokens() const;
+
+private:
+    vector<Token> toks;
+    vector<char *> blocks;
+    char *cur, *end;
+    char *tok;
+    bool comment;
+    int line, col;
+    int tokLine, tokCol;
+
+    void grow(size_t n);
+    void put(char c);
+    void endToken();
+};
+
+#endif // TOKENIZER_H
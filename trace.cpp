@@ -0,0 +1,295 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#include "trace.h"
+#include "stackcpu.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdint.h>
+
+#define TRACEMAGIC "SCTR"
+#define TRACEVERSION 1
+#define TAGOP 0x3f
+#define TAGPC 0x40
+#define TAGTOS 0x80
+// op index of !
+#define STOREOP 0x02
+// encoded bytes gathered before each write
+#define TRACEBUFFER 0x10000
+
+struct TraceHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t memSize;
+    uint32_t flags;
+};
+
+// longest encoded record: tag and four varints
+#define MAXRECORD 21
+
+static inline unsigned char *putVarint(unsigned char *p, int v) {
+    uint32_t u = (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+    while (u >= 0x80) {
+        *p++ = static_cast<unsigned char>(u | 0x80);
+        u >>= 7;
+    }
+    *p++ = static_cast<unsigned char>(u);
+    return p;
+}
+
+TraceWriter::TraceWriter() : ring(TRACERING), head(0), tail(0), limit(0), done(false), f(NULL) {
+}
+
+TraceWriter::~TraceWriter() {
+    string error;
+    close(&error);
+}
+
+bool TraceWriter::open(const string &path, int memSize, string *error) {
+    f = fopen(path.c_str(), "wb");
+    if (!f) {
+        *error = strerror(errno);
+        return false;
+    }
+    TraceHeader h;
+    memcpy(h.magic, TRACEMAGIC, 4);
+    h.version = TRACEVERSION;
+    h.memSize = memSize;
+    h.flags = 0;
+    if (fwrite(&h, sizeof(h), 1, f) != 1) {
+        *error = strerror(errno);
+        fclose(f);
+        f = NULL;
+        return false;
+    }
+    for (int i = 0; i <= TAGOP; ++i) pci[i] = opGetPci(0xff00 | i);
+    failed = false;
+    failErrno = 0;
+    expect = 0;
+    lastTos = 0;
+    lastAddr = 0;
+    done = false;
+    writer = thread(&TraceWriter::loop, this);
+    return true;
+}
+
+// Wait for the writer to drain the ring and close the file.
+bool TraceWriter::close(string *error) {
+    if (!f) return true;
+    done.store(true, memory_order_release);
+    writer.join();
+    if (fclose(f) != 0 && !failed) {
+        failErrno = errno;
+        failed = true;
+    }
+    f = NULL;
+    if (failed) *error = failErrno ? strerror(failErrno) : "write failed";
+    return !failed;
+}
+
+void TraceWriter::loop() {
+    vector<unsigned char> buf(TRACEBUFFER + TRACERING * MAXRECORD);
+    unsigned char *p = buf.data();
+    for (;;) {
+        size_t t = tail.load(memory_order_relaxed);
+        size_t h = head.load(memory_order_acquire);
+        if (t == h) {
+            if (done.load(memory_order_acquire) && head.load(memory_order_acquire) == t) break;
+            flush(buf.data(), &p);
+            this_thread::sleep_for(chrono::microseconds(100));
+            continue;
+        }
+        for (; t != h; ++t) p = encode(ring[t & (TRACERING - 1)], p);
+        tail.store(t, memory_order_release);
+        if (p - buf.data() >= TRACEBUFFER) flush(buf.data(), &p);
+    }
+    flush(buf.data(), &p);
+}
+
+void TraceWriter::flush(unsigned char *buf, unsigned char **p) {
+    size_t n = *p - buf;
+    if (n && fwrite(buf, 1, n, f) != n && !failed) {
+        failErrno = errno;
+        failed = true;
+    }
+    *p = buf;
+}
+
+unsigned char *TraceWriter::encode(const TraceRecord &r, unsigned char *p) {
+    if (r.op == TRACERESET) {
+        *p++ = TAGOP;
+        expect = 0;
+        lastTos = 0;
+        lastAddr = 0;
+        return p;
+    }
+    int tag = r.op;
+    if (r.pc != expect) tag |= TAGPC;
+    if (r.tos != lastTos) tag |= TAGTOS;
+    *p++ = static_cast<unsigned char>(tag);
+    if (tag & TAGPC) p = putVarint(p, r.pc - expect);
+    if (tag & TAGTOS) p = putVarint(p, r.tos - lastTos);
+    if (r.op == STOREOP) {
+        p = putVarint(p, r.addr - lastAddr);
+        p = putVarint(p, r.val);
+        lastAddr = r.addr;
+    }
+    expect = r.pc + pci[r.op];
+    lastTos = r.tos;
+    return p;
+}
+
+TraceReader::TraceReader() : f(NULL), size(0), n(0) {
+}
+
+TraceReader::~TraceReader() {
+    if (f) fclose(f);
+}
+
+bool TraceReader::open(const string &path, string *error) {
+    if (f) fclose(f);
+    f = fopen(path.c_str(), "rb");
+    if (!f) {
+        *error = strerror(errno);
+        return false;
+    }
+    TraceHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, TRACEMAGIC, 4) != 0) {
+        *error = "not a trace file";
+    } else if (h.version != TRACEVERSION) {
+        *error = "unsupported trace version";
+    } else {
+        size = h.memSize;
+        n = 0;
+        expect = 0;
+        lastTos = 0;
+        lastAddr = 0;
+        return true;
+    }
+    fclose(f);
+    f = NULL;
+    return false;
+}
+
+int TraceReader::memSize() const {
+    return size;
+}
+
+// Records read so far, resets included.
+long long TraceReader::position() const {
+    return n;
+}
+
+bool TraceReader::varint(int *v) {
+    uint32_t u = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = fgetc(f);
+        if (c == EOF) return false;
+        u |= static_cast<uint32_t>(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *v = static_cast<int>((u >> 1) ^ (0u - (u & 1)));
+            return true;
+        }
+    }
+    return false;
+}
+
+// Read the next record; false at the end of the trace or on a
+// truncated record.
+bool TraceReader::next(TraceRecord *r) {
+    if (!f) return false;
+    int tag = fgetc(f);
+    if (tag == EOF) return false;
+    int d;
+    if ((tag & TAGOP) == TAGOP) {
+        r->op = TRACERESET;
+        r->pc = r->tos = r->addr = r->val = 0;
+        expect = 0;
+        lastTos = 0;
+        lastAddr = 0;
+        ++n;
+        return true;
+    }
+    r->op = tag & TAGOP;
+    r->pc = expect;
+    r->tos = lastTos;
+    r->addr = r->val = 0;
+    if (tag & TAGPC) {
+        if (!varint(&d)) return false;
+        r->pc += d;
+    }
+    if (tag & TAGTOS) {
+        if (!varint(&d)) return false;
+        r->tos += d;
+    }
+    if (r->op == STOREOP) {
+        if (!varint(&d) || !varint(&r->val)) return false;
+        r->addr = lastAddr + d;
+        lastAddr = r->addr;
+    }
+    expect = r->pc + opGetPci(0xff00 | r->op);
+    lastTos = r->tos;
+    ++n;
+    return true;
+}
+
+// Step cpu through the next count records, or up to the end of the
+// trace. cpu must hold the traced program and be where the trace
+// left off, as after clearStack() for a new trace. Stops with an
+// error at the first instruction that does not match its record.
+bool TraceReader::replay(StackCPU *cpu, long long count, string *error) {
+    if (cpu->getMemSize() != size) {
+        *error = "memory size differs from the traced program";
+        return false;
+    }
+    TraceRecord r;
+    char buff[128];
+    for (long long i = 0; i < count && next(&r); ++i) {
+        if (r.op == TRACERESET) {
+            cpu->clearStack();
+            continue;
+        }
+        const char *what = NULL;
+        long long steps = cpu->instructionCount();
+        // a record off the end of memory cannot match any step
+        if (cpu->pc() != r.pc || r.pc < 0 || r.pc >= cpu->getMemSize()) {
+            what = "pc";
+        } else if (opGetCode(cpu->memory(r.pc)) != r.op) {
+            what = "opcode";
+        } else {
+            // the step may still fail after the instruction ran, with
+            // the PC out of bounds
+            cpu->stepInto();
+            StackView ds = cpu->dataStack();
+            if (cpu->instructionCount() != steps + 1) what = "error";
+            else if ((ds.size ? ds.data[ds.size - 1] : 0) != r.tos) what = "top of stack";
+            else if (r.op == STOREOP && r.addr >= 0 && r.addr < size
+                     && cpu->memory(r.addr) != r.val) what = "store";
+        }
+        if (what) {
+            snprintf(buff, sizeof(buff), "%s differs at record %lld, address %d", what, n - 1, r.pc);
+            *error = buff;
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,130 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+class StackCPU;
+
+#define TRACERING 0x10000
+// op of the record written when the CPU is reset
+#define TRACERESET -1
+
+// One executed instruction: its address and opcode, the top of the
+// data stack afterwards (0 when empty) and, for a store, the address
+// and value written.
+struct TraceRecord {
+    int pc;
+    int op;
+    int tos;
+    int addr, val;
+};
+
+// Streams trace records to a file. put() hands records to a writer
+// thread through a single producer, single consumer ring of TRACERING
+// entries and only waits when the ring is full; the writer encodes
+// them and does the file I/O.
+//
+// File format, after the header (magic "SCTR", version, memory size,
+// flags, 32 bits each, little-endian), one record after another:
+//   tag       low 6 bits the op index, or 0x3f for a reset; 0x40 if
+//             pc follows, 0x80 if tos follows
+//   pc        zigzag varint, difference from the address after the
+//             previous record's instruction; only when it jumped
+//   tos       zigzag varint, difference from the previous tos; only
+//             when it changed
+//   addr, val zigzag varints, for stores: the address as difference
+//             from the previous store's, then the value
+class TraceWriter {
+public:
+    TraceWriter();
+    ~TraceWriter();
+    bool open(const string &path, int memSize, string *error);
+    bool close(string *error);
+    void put(int pc, int op, int tos, int addr = 0, int val = 0) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h - limit == TRACERING) {
+            while (h - tail.load(memory_order_acquire) == TRACERING) this_thread::yield();
+            limit = tail.load(memory_order_acquire);
+        }
+        TraceRecord &r = ring[h & (TRACERING - 1)];
+        r.pc = pc;
+        r.op = op;
+        r.tos = tos;
+        r.addr = addr;
+        r.val = val;
+        head.store(h + 1, memory_order_release);
+    }
+
+private:
+    vector<TraceRecord> ring;
+    atomic<size_t> head, tail;
+    size_t limit;
+    atomic<bool> done;
+    thread writer;
+    FILE *f;
+    bool failed;
+    // errno of the first write or close that failed, 0 if it set none
+    int failErrno;
+    int expect, lastTos, lastAddr;
+    int pci[0x40];
+
+    TraceWriter(const TraceWriter &);
+    TraceWriter &operator=(const TraceWriter &);
+    void loop();
+    void flush(unsigned char *buf, unsigned char **p);
+    unsigned char *encode(const TraceRecord &r, unsigned char *p);
+};
+
+// Reads a trace back. replay() runs a CPU holding the traced program
+// along the trace, checking every instruction against its record, so
+// any point of the run can be inspected, or stepped back from with
+// the journal on.
+class TraceReader {
+public:
+    TraceReader();
+    ~TraceReader();
+    bool open(const string &path, string *error);
+    int memSize() const;
+    long long position() const;
+    bool next(TraceRecord *r);
+    bool replay(StackCPU *cpu, long long count, string *error);
+
+private:
+    FILE *f;
+    int size;
+    long long n;
+    int expect, lastTos, lastAddr;
+
+    TraceReader(const TraceReader &);
+    TraceReader &operator=(const TraceReader &);
+    bool varint(int *v);
+};
+
+#endif // TRACE_H
@@ -0,0 +1,193 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#include "verifier.h"
+#include "stackcpu.h"
+#include <algorithm>
+
+#define DUNDERFLOW "Data stack underflow"
+#define DOVERFLOW "Data stack overflow"
+#define RUNDERFLOW "Return stack underflow"
+#define ROVERFLOW "Return stack overflow"
+
+// entry depth lattice: not reached yet, reached with differing depths
+#define UNSEEN -2
+#define UNKNOWN -1
+
+static bool ends(int opc) {
+    return opc == 0xff02 || opc == 0xff0c || opc == 0xff0d
+        || opc == 0xff0e || opc == 0xff0f;
+}
+
+static int length(const Opcode &op) {
+    return op.pci > 0 ? op.pci : 1;
+}
+
+static const Opcode *opAt(const function<int(int)> &read, const function<bool(int)> &insn, int a) {
+    return insn(a) ? opFind(read(a)) : NULL;
+}
+
+// Block leaders are address 0, IF and CALL targets, the words after
+// IF, CALL and !, and any instruction reached along two paths.
+static void findLeaders(const function<int(int)> &read, const function<bool(int)> &insn,
+                        int size, vector<char> *lead) {
+    vector<char> seen(size, 0);
+    vector<int> work;
+    auto add = [&](int a) {
+        if (a < 0 || a >= size || (*lead)[a]) return;
+        (*lead)[a] = 1;
+        if (!seen[a]) work.push_back(a);
+    };
+    add(0);
+    while (!work.empty()) {
+        int a = work.back();
+        work.pop_back();
+        while (a >= 0 && a < size) {
+            if (seen[a]) {
+                (*lead)[a] = 1;
+                break;
+            }
+            seen[a] = 1;
+            const Opcode *op = opAt(read, insn, a);
+            if (!op) break;
+            if (op->opc == 0xff0c || op->opc == 0xff0d) {
+                add(read(a + 1));
+                add(a + 2);
+            } else if (op->opc == 0xff02) {
+                add(a + 1);
+            }
+            if (ends(op->opc)) break;
+            a += length(*op);
+        }
+    }
+}
+
+// First instruction of b that fails with entry depths d and r, and why.
+static void report(const function<int(int)> &read, const Block &b, int d, int r,
+                   vector<Diagnostic> *diags) {
+    for (int a = b.start; a < b.end; ) {
+        const Opcode *op = opFind(read(a));
+        const char *msg = NULL;
+        if (d < op->dsi) msg = DUNDERFLOW;
+        else if (d - op->dsi + op->dso > MAXSTACK) msg = DOVERFLOW;
+        else if (r < op->rsi) msg = RUNDERFLOW;
+        else if (r - op->rsi + op->rso > MAXSTACK) msg = ROVERFLOW;
+        if (msg) {
+            Diagnostic diag = { a, msg };
+            diags->push_back(diag);
+            return;
+        }
+        d += op->dso - op->dsi;
+        r += op->rso - op->rsi;
+        a += length(*op);
+    }
+}
+
+// Split the reachable code in the first size words into blocks and
+// work out their stack needs. Where the depth on entry to a block is
+// known statically, a block that must overflow or underflow is
+// reported in diags.
+void verify(const function<int(int)> &read, const function<bool(int)> &insn, int size,
+            vector<Block> *blocks, vector<Diagnostic> *diags) {
+    blocks->clear();
+    diags->clear();
+    if (size <= 0) return;
+
+    vector<char> lead(size, 0);
+    findLeaders(read, insn, size, &lead);
+
+    vector<int> at(size, -1);
+    for (int a = 0; a < size; ++a) {
+        if (!lead[a] || !opAt(read, insn, a)) continue;
+        Block b = { a, a, a, 0, 0, 0, 0, 0, 0, 0, true, 0 };
+        int x = a;
+        while (x < size) {
+            const Opcode *op = opAt(read, insn, x);
+            if (!op) break;
+            b.dneed = max(b.dneed, op->dsi - b.ddelta);
+            b.ddelta += op->dso - op->dsi;
+            b.dgrow = max(b.dgrow, b.ddelta);
+            b.rneed = max(b.rneed, op->rsi - b.rdelta);
+            b.rdelta += op->rso - op->rsi;
+            b.rgrow = max(b.rgrow, b.rdelta);
+            b.last = x;
+            ++b.count;
+            x += length(*op);
+            if (ends(op->opc) || (x < size && lead[x])) break;
+        }
+        b.end = min(x, size);
+        at[a] = blocks->size();
+        blocks->push_back(b);
+    }
+
+    // propagate entry depths from address 0
+    vector<int> din(blocks->size(), UNSEEN), rin(blocks->size(), UNSEEN);
+    vector<int> work;
+    auto flow = [&](int a, int d, int r) {
+        if (a < 0 || a >= size || at[a] < 0) return;
+        int i = at[a];
+        if (din[i] == UNSEEN) {
+            din[i] = d;
+            rin[i] = r;
+        } else if (din[i] == d && rin[i] == r) {
+            return;
+        } else if (din[i] == UNKNOWN && rin[i] == UNKNOWN) {
+            return;
+        } else {
+            if (din[i] != d) din[i] = UNKNOWN;
+            if (rin[i] != r) rin[i] = UNKNOWN;
+        }
+        work.push_back(i);
+    };
+    flow(0, 0, 0);
+    while (!work.empty()) {
+        const Block &b = (*blocks)[work.back()];
+        int d = din[work.back()], r = rin[work.back()];
+        work.pop_back();
+        bool dbad = d >= 0 && (d < b.dneed || d + b.dgrow > MAXSTACK);
+        bool rbad = r >= 0 && (r < b.rneed || r + b.rgrow > MAXSTACK);
+        if (dbad || rbad) {
+            report(read, b, d >= 0 ? d : MAXSTACK / 2, r >= 0 ? r : MAXSTACK / 2, diags);
+            continue;
+        }
+        int dn = d >= 0 ? d + b.ddelta : UNKNOWN;
+        int rn = r >= 0 ? r + b.rdelta : UNKNOWN;
+        switch (read(b.last)) {
+        case 0xff0c:
+            flow(read(b.last + 1), dn, rn);
+            flow(b.last + 2, dn, rn);
+            break;
+        case 0xff0d:
+            // the callee's effect is not tracked
+            flow(read(b.last + 1), dn, rn);
+            flow(b.last + 2, UNKNOWN, UNKNOWN);
+            break;
+        case 0xff0e:
+        case 0xff0f:
+            break;
+        default:
+            flow(b.end, dn, rn);
+        }
+    }
+    sort(diags->begin(), diags->end(), [](const Diagnostic &a, const Diagnostic &b) {
+        return a.addr < b.addr;
+    });
+}
@@ -0,0 +1,56 @@
+/****************************************************************************
+**
+** Copyright (C) 2013 Thanatat Tamtan
+**
+** This file is part of Stack CPU.
+**
+** Stack CPU is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation version 3.
+**
+** Stack CPU is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with Stack CPU.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+
+
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Straight-line run of instructions entered only at start. Stack
+// figures are relative to the depths on entry: need is how many
+// entries must be there, grow how far the stack rises above them at
+// most, delta the change once the block has run. last is the address
+// of the final instruction, count the number of instructions.
+struct Block {
+    int start, end;
+    int last, count;
+    int dneed, dgrow, ddelta;
+    int rneed, rgrow, rdelta;
+    // set and used by StackCPU: may run unchecked, decoded op at start
+    bool safe;
+    int op;
+};
+
+struct Diagnostic {
+    int addr;
+    string message;
+};
+
+// read gives the word at an address, insn whether it may run as an
+// instruction rather than being data.
+void verify(const function<int(int)> &read, const function<bool(int)> &insn, int size,
+            vector<Block> *blocks, vector<Diagnostic> *diags);
+
+#endif // VERIFIER_H